@@ -13,10 +13,26 @@ typedef struct atomic {
     __sync_add_and_fetch(&(a)->value, 1)
 #define atomic_dec(a)                           \
     __sync_sub_and_fetch(&(a)->value, 1)
+#define atomic_add(a, n)                        \
+    __sync_add_and_fetch(&(a)->value, n)
 #define atomic_read(a) ({                       \
             __sync_synchronize();               \
             (a)->value; })
 #define atomic_dec_and_test(a)                  \
     (atomic_dec(a) == 0)
 
+/* Ordered accessors for shared words and pointers that are not
+ * atomic_t, e.g., list links walked by lock-free readers. */
+#define load_acquire(p)                         \
+    __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, val)                   \
+    __atomic_store_n(p, val, __ATOMIC_RELEASE)
+
+/* Hint to the CPU that we are busy-waiting. */
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __sync_synchronize()
+#endif
+
 #endif /* CKIT_ATOMIC_H */
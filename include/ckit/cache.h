@@ -0,0 +1,151 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * A bounded cache of reference-counted entries, with an entry or byte
+ * budget, CLOCK or segmented LRU eviction, and per-entry time to
+ * live.
+ *
+ * Lookups take no cache-wide lock: a hit only sets the entry's
+ * reference bit, which the eviction scan consumes when it passes the
+ * entry. Inserts and removals are serialized by the cache lock.
+ *
+ * Expired entries are removed lazily when looked up, and optionally
+ * by a sweep that runs from a timer queue and checks a bounded number
+ * of entries per run.
+ *
+ * Authors: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#ifndef CKIT_CACHE_H
+#define CKIT_CACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <ckit/hashtable.h>
+#include <ckit/timer.h>
+#include <ckit/list.h>
+
+typedef enum cache_policy {
+    /* Entries sit on a single ring. The eviction hand gives entries
+     * that were hit since it last passed a second chance. */
+    CACHE_CLOCK,
+    /* Entries start in a probationary segment and are promoted to a
+     * protected segment if hit before reaching its end. Protects hot
+     * entries against scans. */
+    CACHE_SLRU,
+} cache_policy_t;
+
+typedef struct cache_entry {
+    struct hashelm he;
+    list_t lru; /* Position in the CLOCK ring or an SLRU segment */
+    list_t exp; /* Position on the expiry list, if it has a TTL */
+    unsigned long size; /* Bytes charged against the budget */
+    uint64_t expires; /* ck_now_ns() nanoseconds, 0 for never */
+    unsigned char ref; /* Hit since the eviction scan last passed */
+    unsigned char protected; /* In the SLRU protected segment */
+    unsigned char cached;
+} cache_entry_t;
+
+typedef unsigned int (*cache_hashfn_t)(const void *key, uint64_t seed);
+typedef int (*cache_equalfn_t)(const struct cache_entry *ce, const void *key);
+typedef void (*cache_freefn_t)(struct cache_entry *ce);
+
+typedef struct cache {
+    struct hashtable ht;
+    pthread_mutex_t lock;
+    cache_policy_t policy;
+    list_t probation; /* CLOCK ring or SLRU probationary segment */
+    list_t protected;
+    list_t expiry;
+    unsigned long max_entries; /* 0 for no limit */
+    unsigned long max_bytes; /* 0 for no limit */
+    unsigned long entries;
+    unsigned long bytes;
+    unsigned long protected_entries;
+    unsigned long protected_bytes;
+    cache_equalfn_t equalfn;
+    cache_freefn_t freefn;
+    struct timer_queue *tq; /* Runs the expiry sweep, if any */
+    struct timer sweep;
+} cache_t;
+
+#define cache_entry(ptr, type, member)          \
+    get_enclosing(ptr, type, member)
+
+/**
+ * Initialize a cache that holds at most 'max_entries' entries and
+ * 'max_bytes' bytes, as charged by cache_insert(). Either limit may
+ * be zero for none. The free function is called when the last
+ * reference to an entry is dropped.
+ */
+int cache_init(struct cache *c, cache_policy_t policy,
+               unsigned long max_entries, unsigned long max_bytes,
+               cache_hashfn_t hashfn, cache_equalfn_t equalfn,
+               cache_freefn_t freefn);
+
+/**
+ * Remove all entries and free the cache's resources. The expiry sweep
+ * must have been stopped.
+ */
+void cache_fini(struct cache *c);
+
+/**
+ * Initialize an entry before it is inserted. The caller holds the
+ * initial reference.
+ */
+void cache_entry_init(struct cache_entry *ce);
+
+/**
+ * Insert an entry under the given key, replacing any entry with the
+ * same key, and evict entries until the cache is within its budget.
+ * The entry is charged 'size' bytes and expires after 'ttl'
+ * microseconds, or never if zero, as read by ck_now_ns() on the
+ * calling thread's clock source. The cache takes its own reference,
+ * so the caller should drop its own when done with the entry. An
+ * entry that was removed or evicted first waits for lock-free readers
+ * to leave it, without holding the cache lock. Returns -1 if the
+ * entry alone exceeds the byte budget, or if it would have to wait
+ * from within an epoch read-side section.
+ */
+int cache_insert(struct cache *c, struct cache_entry *ce, const void *key,
+                 unsigned long size, unsigned long ttl);
+
+/**
+ * Lookup the entry stored under the given key. A returned entry has
+ * its reference count incremented and must be released with
+ * cache_entry_put(). Returns NULL if not found or expired.
+ */
+struct cache_entry *cache_lookup(struct cache *c, const void *key);
+
+/**
+ * Remove an entry from the cache, if it is still there.
+ */
+void cache_remove(struct cache *c, struct cache_entry *ce);
+
+/**
+ * Start removing expired entries from the given timer queue, checking
+ * a bounded number of entries every 'interval' microseconds.
+ */
+int cache_start_expiry(struct cache *c, struct timer_queue *tq,
+                       unsigned long interval);
+
+/**
+ * Stop the expiry sweep. Must not race with the thread that handles
+ * the timer queue's timeouts.
+ */
+void cache_stop_expiry(struct cache *c);
+
+static inline unsigned long cache_count(struct cache *c)
+{
+    return c->entries;
+}
+
+static inline void cache_entry_hold(struct cache_entry *ce)
+{
+    hashelm_hold(&ce->he);
+}
+
+static inline void cache_entry_put(struct cache_entry *ce)
+{
+    hashelm_put(&ce->he);
+}
+
+#endif /* CKIT_CACHE_H */
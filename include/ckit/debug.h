@@ -12,8 +12,8 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <errno.h>
-#include <sys/time.h>
 #include <ckit/log.h>
+#include <ckit/time.h>
 
 #ifndef LOG_TAG
 #define LOG_TAG "ckit"
@@ -55,12 +55,18 @@ void ck_dbg_set_sync_mode(struct ck_dbg *dbg);
 #define DBG_SET_LEVEL(level)                    \
     ck_dbg_set_level(dbg_log, level)
 
+/*
+  Log lines are stamped with ck_now_ns(), i.e., monotonic time rather
+  than wall clock time, which may lag by up to an event loop iteration
+  in a thread reading CK_CLOCK_CACHED. ck_dbg_open() logs the wall
+  clock time at the start of the log.
+*/
 #define __LOG(level, format, ...) ({                                    \
-            struct timeval now;                                         \
-            gettimeofday(&now, NULL);                                   \
+            uint64_t now = ck_now_ns();                                 \
             ck_dbg_print(dbg_log, level, LOG_TAG,                       \
                          "%ld.%06ld %-4s %s %s: "format,                \
-                         (long)now.tv_sec, (long)now.tv_usec,           \
+                         (long)(now / NSEC_PER_SEC),                    \
+                         (long)(now % NSEC_PER_SEC / NSEC_PER_USEC),    \
                          ck_dbg_level_to_str(level),                    \
                          LOG_TAG, __func__,                             \
                          ##__VA_ARGS__);                                \
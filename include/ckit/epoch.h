@@ -0,0 +1,74 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Epoch-based memory reclamation. Readers enter an epoch to walk
+ * shared data structures without locks or shared writes, and writers
+ * defer freeing unlinked objects until every reader that could still
+ * see them has left its epoch.
+ *
+ * Authors: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#ifndef CKIT_EPOCH_H
+#define CKIT_EPOCH_H
+
+typedef struct epoch_entry {
+    struct epoch_entry *next;
+    unsigned long epoch;
+    void (*fn)(struct epoch_entry *e);
+} epoch_entry_t;
+
+/**
+ * Enter a read-side critical section. Objects reachable from shared
+ * structures will not be reclaimed until epoch_exit() is
+ * called. Sections may be nested, but must not block for long since
+ * that stalls reclamation for all threads.
+ */
+void epoch_enter(void);
+
+/**
+ * Leave a read-side critical section.
+ */
+void epoch_exit(void);
+
+/**
+ * Check whether the calling thread is in a read-side section.
+ */
+int epoch_in_section(void);
+
+/**
+ * Defer calling 'fn' on the entry until all threads that were in a
+ * read-side section when this function was called have left it.
+ */
+void epoch_defer(struct epoch_entry *e, void (*fn)(struct epoch_entry *));
+
+/**
+ * Return the current global epoch, to be later passed to
+ * epoch_elapsed().
+ */
+unsigned long epoch_snapshot(void);
+
+/**
+ * Check whether a full grace period has passed since the given
+ * snapshot was taken, trying to advance the epoch if not. Never
+ * blocks.
+ */
+int epoch_elapsed(unsigned long epoch);
+
+/**
+ * Try to advance the epoch and run deferred callbacks that are safe
+ * to run. Returns the number of callbacks run.
+ */
+int epoch_poll(void);
+
+/**
+ * Wait until a full grace period has passed and run all callbacks
+ * deferred before the call. Must not be called from within a
+ * read-side section.
+ */
+void epoch_synchronize(void);
+
+#define epoch_entry(e, type, member)            \
+    get_enclosing(e, type, member)
+
+#include <ckit/ckit.h>
+
+#endif /* CKIT_EPOCH_H */
@@ -0,0 +1,99 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Open-addressing hash table in the style of Swiss tables. Key and
+ * value pointers are stored inline in groups of slots, next to an
+ * array of control bytes holding seven bits of each key's hash. A
+ * lookup compares a whole group of control bytes at once (using SSE2
+ * when available) and only touches the slots whose control byte
+ * matches.
+ *
+ * Unlike struct hashtable, a flat hash table is not thread-safe and
+ * does not reference count its values; callers that share a table
+ * between threads must serialize access to it.
+ *
+ * Authors: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#ifndef CKIT_FLATHASH_H
+#define CKIT_FLATHASH_H
+
+#include <stdint.h>
+
+#define FLATHASH_GROUP_SIZE 16
+
+typedef unsigned int (*flathash_hashfn_t)(const void *key, uint64_t seed);
+typedef int (*flathash_equalfn_t)(const void *key1, const void *key2);
+
+typedef struct flathash_slot {
+    const void *key;
+    void *value;
+} flathash_slot_t;
+
+typedef struct flathash {
+    signed char *ctrl;
+    struct flathash_slot *slots;
+    unsigned int mask; /* Number of groups - 1 */
+    unsigned int count;
+    unsigned int growth_left; /* Inserts left before a rehash */
+    uint64_t seed; /* Passed to hashfn to resist hash flooding */
+    flathash_hashfn_t hashfn;
+    flathash_equalfn_t equalfn;
+} flathash_t;
+
+/**
+ * Initialize a flat hash table that can hold at least 'size'
+ * elements before it grows.
+ */
+int flathash_init(struct flathash *fh, unsigned int size,
+                  flathash_hashfn_t hashfn, flathash_equalfn_t equalfn);
+
+/**
+ * Set the seed that the hash function hashes every key with. A random
+ * seed is chosen by flathash_init(), so this is only needed for
+ * reproducible layouts. Must be called on an empty table.
+ */
+static inline void flathash_set_seed(struct flathash *fh, uint64_t seed)
+{
+    fh->seed = seed;
+}
+
+/**
+ * Free the table's memory. Keys and values are not touched.
+ */
+void flathash_fini(struct flathash *fh);
+
+/**
+ * Insert a value under the given key. The key is stored by pointer
+ * and must remain valid while it is in the table. Returns -1 if the
+ * key already exists or memory could not be allocated.
+ */
+int flathash_insert(struct flathash *fh, const void *key, void *value);
+
+/**
+ * Lookup the value stored under the given key, or NULL if not found.
+ */
+void *flathash_lookup(struct flathash *fh, const void *key);
+
+/**
+ * Remove the given key from the table, returning its value or NULL
+ * if not found.
+ */
+void *flathash_erase(struct flathash *fh, const void *key);
+
+/**
+ * Apply a function to every key and value in the table. The table
+ * must not be modified by the function. Returns the number of
+ * elements visited.
+ */
+int flathash_foreach(struct flathash *fh,
+                     void (*action)(const void *key, void *value, void *data),
+                     void *data);
+
+/**
+ * Returns the number of elements in the table.
+ */
+static inline unsigned int flathash_count(struct flathash *fh)
+{
+    return fh->count;
+}
+
+#endif /* CKIT_FLATHASH_H */
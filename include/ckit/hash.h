@@ -2,6 +2,10 @@
 #ifndef CKIT_HASH_H
 #define CKIT_HASH_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
 /*
   Based on sdbm hash.
 */
@@ -10,25 +14,187 @@ static inline unsigned long partial_byte_hash(unsigned long c, unsigned long has
     return (c + (hash << 6) + (hash << 16) - hash);
 }
 
-static inline unsigned long byte_array_hash(const void *bytes, size_t len)
+/*
+  Integer mixers. These are bijective, so distinct keys never
+  collide, and every input bit affects every output bit.
+*/
+static inline uint32_t hash_mix32(uint32_t h)
 {
-    const unsigned char *ptr = (const unsigned char *)bytes;
-    unsigned long hash = 0;
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline uint64_t hash_mix64(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static inline uint32_t hash_u32_seed(uint32_t key, uint64_t seed)
+{
+    return (uint32_t)hash_mix64(key ^ seed);
+}
+
+static inline uint32_t hash_u64_seed(uint64_t key, uint64_t seed)
+{
+    return (uint32_t)hash_mix64(key ^ seed);
+}
 
-    while (len--)
-        hash = partial_byte_hash(*ptr++, hash);
+/*
+  Byte array hashing that consumes 16 bytes per step for medium keys
+  and 48 bytes per step, in three independent lanes, for longer
+  ones. Keys of HASH_LONG_MIN bytes or more are handed to
+  hash_bytes_long(), which uses SSE2 when available. Results depend
+  on the seed and on host byte order.
+*/
+#define HASH_P0 0xa0761d6478bd642fULL
+#define HASH_P1 0xe7037ed1a0b428dbULL
+#define HASH_P2 0x8ebc6af09c88c6e3ULL
+#define HASH_P3 0x589965cc75374cc3ULL
+
+#define HASH_LONG_MIN 256
+
+/*
+  Multiply and fold the 128-bit product.
+*/
+static inline uint64_t hash_mum(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    uint64_t ha = a >> 32, hb = b >> 32;
+    uint64_t la = (uint32_t)a, lb = (uint32_t)b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), lo, hi;
+
+    hi = rh + (rm0 >> 32) + (rm1 >> 32) + (t < rl);
+    lo = t + (rm1 << 32);
+    hi += (lo < t);
+    return lo ^ hi;
+#endif
+}
+
+static inline uint64_t hash_read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
 
-    return hash;
+static inline uint64_t hash_read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/*
+  Hash the bulk of a long key, returning the updated seed and setting
+  'consumed' to the number of bytes processed.
+*/
+uint64_t hash_bytes_long(const unsigned char *p, size_t len,
+                         uint64_t seed, size_t *consumed);
+
+static inline uint64_t hash_bytes_seed(const void *bytes, size_t len,
+                                       uint64_t seed)
+{
+    const unsigned char *p = (const unsigned char *)bytes;
+    uint64_t a, b;
+
+    seed ^= hash_mum(seed ^ HASH_P0, HASH_P1);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t off = (len >> 3) << 2;
+            a = (hash_read32(p) << 32) | hash_read32(p + off);
+            b = (hash_read32(p + len - 4) << 32) |
+                hash_read32(p + len - 4 - off);
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) |
+                p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        const unsigned char *end = p + len;
+        size_t i = len;
+
+        if (i >= HASH_LONG_MIN) {
+            size_t n;
+
+            seed = hash_bytes_long(p, i, seed, &n);
+            p += n;
+            i -= n;
+        }
+
+        if (i > 48) {
+            uint64_t s1 = seed, s2 = seed;
+
+            do {
+                seed = hash_mum(hash_read64(p) ^ HASH_P1,
+                                hash_read64(p + 8) ^ seed);
+                s1 = hash_mum(hash_read64(p + 16) ^ HASH_P2,
+                              hash_read64(p + 24) ^ s1);
+                s2 = hash_mum(hash_read64(p + 32) ^ HASH_P3,
+                              hash_read64(p + 40) ^ s2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= s1 ^ s2;
+        }
+
+        while (i > 16) {
+            seed = hash_mum(hash_read64(p) ^ HASH_P1,
+                            hash_read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+
+        /* The last 16 bytes, which may overlap with those already
+         * consumed */
+        a = hash_read64(end - 16);
+        b = hash_read64(end - 8);
+    }
+    a ^= HASH_P1;
+    b ^= seed;
+    return hash_mum(HASH_P1 ^ len, hash_mum(a, b) ^ HASH_P0);
+}
+
+static inline uint64_t hash_string_seed(const char *str, uint64_t seed)
+{
+    return hash_bytes_seed(str, strlen(str), seed);
+}
+
+/**
+ * Return a seed that is hard to guess from outside the process, for
+ * hash tables exposed to untrusted keys.
+ */
+uint64_t hash_random_seed(void);
+
+/*
+  Hash functions of hash tables are passed the table's seed, which
+  they should hash the key with so that keys colliding under one seed
+  do not collide under another.
+*/
+static inline unsigned long byte_array_hash(const void *bytes, size_t len,
+                                            uint64_t seed)
+{
+    return (unsigned long)hash_bytes_seed(bytes, len, seed);
 }
 
-static inline unsigned long string_hash(const char *str)
+static inline unsigned long string_hash(const char *str, uint64_t seed)
 {
-    unsigned long hash = 0;
-    
-    while (*str != '\0') 
-        hash = partial_byte_hash(*str++, hash);
-    
-    return hash;
+    return (unsigned long)hash_string_seed(str, seed);
 }
 
 #endif /* CKIT_HASH_H */
@@ -0,0 +1,84 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Immutable hash tables built from a populated struct hashtable with
+ * a minimal perfect hash function. Every element is found with a
+ * single probe into a contiguous array, without locks and without
+ * reference counting. Suited for tables that are built once and then
+ * only read, e.g., dispatch tables.
+ *
+ * A frozen table can be rebuilt in the background while the source
+ * table is updated, and published to readers with
+ * hashfrozen_publish(). Readers look it up within an epoch:
+ *
+ *   epoch_enter();
+ *   he = hashfrozen_lookup(load_acquire(&frozen), key);
+ *   ...
+ *   epoch_exit();
+ *
+ * Authors: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#ifndef CKIT_HASHFROZEN_H
+#define CKIT_HASHFROZEN_H
+
+#include <stdint.h>
+#include <ckit/hashtable.h>
+#include <ckit/epoch.h>
+
+struct hashfrozen_disp {
+    unsigned int d0;
+    unsigned int d1;
+};
+
+struct hashfrozen_entry {
+    unsigned int hash;
+    struct hashelm *he;
+};
+
+typedef struct hashfrozen {
+    unsigned int count; /* Number of elements */
+    unsigned int npos; /* Number of distinct hashes */
+    unsigned int nbuckets;
+    uint64_t seed; /* Of the source table's hashes */
+    uint64_t pseed; /* Of the perfect hash function */
+    hashfn_t hashfn;
+    equalfn_t equalfn;
+    struct hashfrozen_disp *disp; /* Of each bucket */
+    unsigned int *start; /* First entry of each hash, if not unique */
+    struct hashfrozen_entry *entries;
+    struct epoch_entry rcu;
+} hashfrozen_t;
+
+/**
+ * Build a frozen table holding the elements of the given table, with
+ * a reference taken on each. The source table may be concurrently
+ * updated, in which case those updates may or may not be included.
+ * Must not be called from within an epoch read-side section. Returns
+ * NULL on failure.
+ */
+struct hashfrozen *hashtable_freeze(struct hashtable *ht);
+
+/**
+ * Lookup an element in a frozen table. No reference is taken, so the
+ * element is only valid as long as the frozen table is.
+ */
+struct hashelm *hashfrozen_lookup(const struct hashfrozen *hf,
+                                  const void *key);
+
+/**
+ * Free a frozen table, dropping its references to elements.
+ */
+void hashfrozen_free(struct hashfrozen *hf);
+
+/**
+ * Atomically replace the frozen table at 'ptr' with 'hf'. The old
+ * table, if any, is freed once all readers that may be using it have
+ * left their epochs.
+ */
+void hashfrozen_publish(struct hashfrozen **ptr, struct hashfrozen *hf);
+
+static inline unsigned int hashfrozen_count(const struct hashfrozen *hf)
+{
+    return hf->count;
+}
+
+#endif /* CKIT_HASHFROZEN_H */
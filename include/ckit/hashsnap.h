@@ -0,0 +1,117 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Hash table snapshots. A snapshot is a file holding the keys and
+ * values of a hash table's elements, as byte strings produced by a
+ * caller-supplied encoder, together with a bucket index over them.
+ * It can be memory-mapped and queried in place, e.g., to serve
+ * lookups while a live table is rebuilt after a restart. Pages are
+ * only read from disk as lookups touch them.
+ *
+ * All offsets in the file are relative to its start, so a snapshot
+ * can be mapped at any address. Integers are stored in host byte
+ * order, and a snapshot written on a host of different byte order is
+ * rejected.
+ *
+ * Authors: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#ifndef CKIT_HASHSNAP_H
+#define CKIT_HASHSNAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ckit/hashtable.h>
+
+#define HASHSNAP_MAGIC "CKHSNAP"
+#define HASHSNAP_VERSION 1
+
+/*
+  File layout: the header, the records, the index entries ordered by
+  bucket, and 'nbuckets + 1' bucket start positions into the index.
+  Each record is its key and value lengths followed by the key and
+  value bytes, padded to eight bytes.
+*/
+struct hashsnap_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; /* 0x01020304 as written by the host */
+    uint64_t seed; /* Seed of the key hashes */
+    uint64_t count; /* Number of records */
+    uint64_t nbuckets; /* Power of two */
+    uint64_t index_off;
+    uint64_t buckets_off;
+    uint64_t size; /* Of the whole file */
+};
+
+struct hashsnap_index {
+    uint64_t hash;
+    uint64_t offset; /* Of the record */
+};
+
+struct hashsnap_rec {
+    uint32_t key_len;
+    uint32_t value_len;
+    unsigned char data[0];
+};
+
+typedef struct hashsnap_record {
+    const void *key;
+    size_t key_len;
+    const void *value;
+    size_t value_len;
+} hashsnap_record_t;
+
+/*
+  Fill in the key and value bytes of an element's record. The bytes
+  need only stay valid until the next call. Return -1 to leave the
+  element out of the snapshot.
+*/
+typedef int (*hashsnap_encodefn_t)(const struct hashelm *he,
+                                   struct hashsnap_record *rec,
+                                   void *data);
+
+typedef struct hashsnap {
+    const unsigned char *base;
+    size_t size;
+    const struct hashsnap_header *hdr;
+    const struct hashsnap_index *index;
+    const uint64_t *buckets;
+} hashsnap_t;
+
+/**
+ * Write a snapshot of a hash table to the given path. A reference is
+ * taken to each element under its slot's read lock, and elements are
+ * encoded and written after all locks are released, so concurrent
+ * updates may or may not be part of the snapshot, and elements
+ * unhashed meanwhile may still be. The encoder must thus tolerate
+ * concurrent updates to an element. The file is written under a
+ * unique temporary name in the same directory, with mode 0600, and
+ * renamed into place once complete. Must not be called from within
+ * an epoch read-side section.
+ */
+int hashtable_snapshot(struct hashtable *ht, const char *path,
+                       hashsnap_encodefn_t encode, void *data);
+
+/**
+ * Map a snapshot for reading.
+ */
+int hashsnap_open(struct hashsnap *hs, const char *path);
+
+/**
+ * Unmap a snapshot. Values returned by hashsnap_lookup() are no
+ * longer valid after this.
+ */
+void hashsnap_close(struct hashsnap *hs);
+
+/**
+ * Lookup the value stored under the given key bytes. On success, the
+ * value points into the mapped file. Returns -1 if not found.
+ */
+int hashsnap_lookup(struct hashsnap *hs, const void *key, size_t key_len,
+                    const void **value, size_t *value_len);
+
+static inline uint64_t hashsnap_count(struct hashsnap *hs)
+{
+    return hs->hdr->count;
+}
+
+#endif /* CKIT_HASHSNAP_H */
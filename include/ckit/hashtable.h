@@ -11,7 +11,9 @@
 #include <ckit/hash.h>
 #include <ckit/list.h>
 #include <ckit/atomic.h>
+#include <ckit/epoch.h>
 #include <string.h>
+#include <pthread.h>
 
 struct hashtable;
 
@@ -21,38 +23,102 @@ typedef struct hashelm {
     unsigned int hash;
 	const void *key;
     struct hashtable *ht;
+    struct epoch_entry rcu; /* Deferred release in HTABLE_F_RCU tables */
+    unsigned int grace; /* Unhashed, but the release is still deferred */
 } hashelm_t;
 
-typedef unsigned int (*hashfn_t)(const void *key);
+typedef unsigned int (*hashfn_t)(const void *key, uint64_t seed);
 typedef int (*equalfn_t)(const struct hashelm *elm, const void *key);
 typedef void (*freefn_t)(struct hashelm *elm);
 
 #define HTABLE_MIN_SIZE 32
 
+typedef enum hashtable_flag {
+    /* Lookups walk bucket chains without locks or shared writes
+     * under epoch protection, and unhashed elements are released
+     * only once all readers have left their epoch. */
+    HTABLE_F_RCU = (1 << 0),
+    /* Slot locks. By default every slot has its own pthread
+     * rwlock. The alternatives, of which at most one may be set,
+     * pad a slot to 32 bytes, two per cache line: */
+    /* A reader-writer spinlock word in each slot. */
+    HTABLE_F_LOCK_SPIN = (1 << 1),
+    /* A sequence counter in each slot. Lookups never write to shared
+     * memory and retry if the slot changed under them. Implies
+     * HTABLE_F_RCU. */
+    HTABLE_F_LOCK_SEQ = (1 << 2),
+    /* A fixed set of pthread rwlocks, each shared by many slots. */
+    HTABLE_F_LOCK_STRIPED = (1 << 3),
+} hashtable_flag_t;
+
+#define HTABLE_LOCK_STRIPES 256
+
+struct hashslots;
+struct hashstripe;
+
+/*
+  The table grows and shrinks with its load factor. A resize
+  allocates a new slot array and then migrates a few buckets of the
+  old one on every subsequent operation, so that no single call pays
+  for a full rehash. While migrating, an element lives either in its
+  old bucket or, once that bucket is marked migrated, in the new one.
+  Slot arrays are only freed once no operation can still be using
+  them, using epoch-based reclamation.
+*/
 typedef struct hashtable {
-	struct hashslot *table;
-    unsigned int mask;
+	struct hashslots *table;
+    struct hashslots *old_table; /* Non-NULL while migrating */
+    unsigned int min_size;
+    unsigned int flags;
+    uint64_t seed; /* Passed to hashfn to resist hash flooding */
+    pthread_mutex_t resize_lock; /* Serializes start/finish of resizes */
+    struct hashstripe *stripes; /* HTABLE_F_LOCK_STRIPED locks */
+    unsigned int stripe_mask;
     atomic_t count;
     hashfn_t hashfn;
     equalfn_t equalfn;
     freefn_t freefn;
 } hashtable_t;
 
-static inline unsigned int default_hashfn(const void *key)
+static inline unsigned int default_hashfn(const void *key, uint64_t seed)
 {
-    return *((unsigned int *)key);
+    return hash_u32_seed(*((unsigned int *)key), seed);
+}
+
+static inline unsigned int string_hashfn(const void *key, uint64_t seed)
+{
+    return (unsigned int)string_hash((const char *)key, seed);
 }
 
 /**
  * Initialize hash table of given size, hash function, equal function
  * and free functions to be applied to hashed elments. Must be called
- * once for every hash table before use.
+ * once for every hash table before use. The size is rounded up to a
+ * power of two and is the size the table shrinks back to when its
+ * load decreases.
  */
 int hashtable_init(struct hashtable *ht, unsigned int size, 
                    hashfn_t hashfn, equalfn_t equalfn, freefn_t freefn);
 
 /**
- * Cleanup and free hash table.
+ * Initialize hash table like hashtable_init(), with additional
+ * hashtable_flag options. Returns -1 if more than one lock mode is
+ * given.
+ */
+int hashtable_init_flags(struct hashtable *ht, unsigned int size,
+                         hashfn_t hashfn, equalfn_t equalfn, freefn_t freefn,
+                         unsigned int flags);
+
+/**
+ * Set the seed that the hash function hashes every key with. A random
+ * seed is chosen by hashtable_init(), so this is only needed for
+ * reproducible hashes. Must be called before any element is hashed.
+ */
+void hashtable_set_seed(struct hashtable *ht, uint64_t seed);
+
+/**
+ * Cleanup and free hash table. Must not be called from within an
+ * epoch read-side section.
  */
 void hashtable_fini(struct hashtable *ht);
 
@@ -65,6 +131,26 @@ void hashtable_fini(struct hashtable *ht);
  */
 hashelm_t *hashtable_lookup(struct hashtable *ht, const void *key);
 
+/**
+ * Lookup 'n' keys at once. All keys are hashed and their slots and
+ * first chain elements prefetched before any of them is resolved, so
+ * that the cache misses of a batch overlap. On return, elms[i] holds
+ * the element for keys[i] with its reference count incremented, or
+ * NULL if not found. Returns the number of elements found.
+ */
+unsigned int hashtable_lookup_many(struct hashtable *ht,
+                                   const void *const *keys, unsigned int n,
+                                   hashelm_t **elms);
+
+/**
+ * Lookup an element in a HTABLE_F_RCU hash table without taking a
+ * lock or a reference. Must be called between epoch_enter() and
+ * epoch_exit(), and the returned element may only be used until
+ * epoch_exit(). Use hashtable_lookup() to keep an element across a
+ * blocking operation.
+ */
+hashelm_t *hashtable_lookup_rcu(struct hashtable *ht, const void *key);
+
 /**
  * Returns the number of elementes in the hash table.
  */
@@ -72,7 +158,8 @@ unsigned int hashtable_count(struct hashtable *ht);
 
 /**
  * Apply a function to every element in the hash table.
- * A write lock is acquired for each hash slot.
+ * A write lock is acquired for each hash slot. Must not be called
+ * from within an epoch read-side section.
  */
 int hashtable_foreach(struct hashtable *ht, 
                       void (*action)(struct hashelm *, void *), 
@@ -80,17 +167,70 @@ int hashtable_foreach(struct hashtable *ht,
 
 /**
  * Apply a function to every element in the hash table.
- * A read lock is acquired for each hash slot.
+ * A read lock is acquired for each hash slot. Must not be called
+ * from within an epoch read-side section.
  */
 int hashtable_foreach_read(struct hashtable *ht, 
                            void (*action)(struct hashelm *, void *), 
                            void *data);
 
+typedef enum hashtable_foreach_flag {
+    /* Take read locks rather than write locks. */
+    HTABLE_FOREACH_READ = (1 << 0),
+    /* Take a reference to each element of a slot under its read lock
+     * and run the function on them after the lock is released. The
+     * function may then take table locks, e.g., to unhash elements,
+     * and does not block inserts, but may see elements that were
+     * unhashed after the snapshot. */
+    HTABLE_FOREACH_UNLOCKED = (1 << 1),
+} hashtable_foreach_flag_t;
+
+/**
+ * Apply a function to every element in the hash table using
+ * 'nthreads' threads, including the calling one, that each visit a
+ * share of the slots. The function may thus run concurrently on
+ * different elements. Locking is chosen with hashtable_foreach_flag
+ * options. The table is not resized during the traversal. Must not
+ * be called from within an epoch read-side section. Returns the
+ * number of elements visited.
+ */
+int hashtable_foreach_parallel(struct hashtable *ht, unsigned int nthreads,
+                               void (*action)(struct hashelm *, void *),
+                               void *data, unsigned int flags);
+
 /**
- * Insert element into hash table based on given key.
+ * Insert element into hash table based on given key. An element
+ * unhashed from an HTABLE_F_RCU table can only be inserted again once
+ * a grace period has passed, so this waits for one if needed, or
+ * fails if called from within an epoch read-side section. The same
+ * goes for the other functions that insert elements.
  */
 int hashtable_hash(struct hashtable *ht, struct hashelm *he, const void *key);
 
+/**
+ * Return the element stored under the given key, or insert the given
+ * element if there is none. Either way, the returned element has its
+ * reference count incremented and must be followed by a
+ * hashelm_put(). Only hashes the key and locks its slot once. Returns
+ * NULL if the element is already hashed.
+ */
+hashelm_t *hashtable_lookup_or_insert(struct hashtable *ht, struct hashelm *he,
+                                      const void *key);
+
+/**
+ * Insert an element, replacing any element stored under the same
+ * key. If 'old' is non-NULL, it is set to the replaced element, with
+ * its reference count incremented, or NULL if there was none.
+ */
+int hashtable_replace(struct hashtable *ht, struct hashelm *he,
+                      const void *key, struct hashelm **old);
+
+/**
+ * Remove the element stored under the given key. Returns the removed
+ * element with its reference count incremented, or NULL if not found.
+ */
+hashelm_t *hashtable_remove_key(struct hashtable *ht, const void *key);
+
 /**
  * Remove an element from the hash table.
  */
@@ -107,6 +247,15 @@ void __hashtable_unhash(struct hashtable *ht, struct hashelm *he);
  */
 int hashelm_hashed(struct hashelm *he);
 
+/**
+ * Wait until an element unhashed from an HTABLE_F_RCU table can be
+ * hashed again, which is once no lock-free reader can still be on it.
+ * Hashing the element waits for this anyway, but calling it first
+ * keeps the wait out of any locks held while hashing. Returns -1 if
+ * it would have to wait from within an epoch read-side section.
+ */
+int hashelm_wait_grace(struct hashelm *he);
+
 /**
  * Increment reference count on hash element.
  */
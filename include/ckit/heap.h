@@ -12,15 +12,33 @@ typedef struct heapitem {
     unsigned char active;
 } heapitem_t;
 
+#define HEAP_MAX_ARITY 8
+
 typedef struct heap {
     unsigned int max_size;
     unsigned int size;
+    unsigned int arity; /* Children per item */
+    int shrink; /* Halve the array when a quarter full */
     int (*cmp)(const struct heapitem *i1, const struct heapitem *i2);
     struct heapitem **map;
+    void *mem; /* Allocation holding map */
 } heap_t;
 
+/**
+ * Initialize a binary heap. The 'cmp' function returns non-zero if
+ * the first item should come before the second.
+ */
 int heap_init(struct heap *h, unsigned int max_size, 
               int (*cmp)(const struct heapitem *i1, const struct heapitem *i2));
+
+/**
+ * Initialize a heap where each item has 'arity' children, between 2
+ * and HEAP_MAX_ARITY. A higher arity makes the heap shallower, with
+ * fewer cache misses on insert and remove for large heaps, at the
+ * cost of more comparisons per level.
+ */
+int heap_init_arity(struct heap *h, unsigned int max_size, unsigned int arity,
+                    int (*cmp)(const struct heapitem *i1, const struct heapitem *i2));
 void heap_fini(struct heap *h);
 int heap_empty(struct heap *h);
 int heap_full(struct heap *h);
@@ -28,6 +46,37 @@ struct heapitem *heap_front(struct heap *h);
 unsigned int heap_size(struct heap *h);
 int heap_insert(struct heap *h, struct heapitem *item);
 struct heapitem *heap_remove(struct heap *h, unsigned int index);
+
+/**
+ * Make room for at least 'size' items in total.
+ */
+int heap_reserve(struct heap *h, unsigned int size);
+
+/**
+ * Insert 'n' items at once. Large batches are appended and the heap
+ * rebuilt in linear time.
+ */
+int heap_insert_many(struct heap *h, struct heapitem **items, unsigned int n);
+
+/**
+ * Replace the contents of the heap with the given items, in linear
+ * time.
+ */
+int heap_build(struct heap *h, struct heapitem **items, unsigned int n);
+
+/**
+ * Let the item array shrink as items are removed. Off by default.
+ */
+static inline void heap_set_shrink(struct heap *h, int shrink)
+{
+    h->shrink = shrink;
+}
+
+/**
+ * Restore heap order after the priority of an item in the heap has
+ * changed, in a single pass up or down from the item's position.
+ */
+void heap_update(struct heap *h, struct heapitem *item);
 static inline struct heapitem *heap_remove_first(struct heap *h)
 {
     return heap_remove(h, 0);
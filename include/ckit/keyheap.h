@@ -0,0 +1,95 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Heap ordered by 64-bit integer keys stored inline in the heap's
+ * array, next to each item pointer. Keys are compared directly, with
+ * smaller keys first, so sifting only touches the array and never
+ * the items themselves. Items are the same struct heapitem as used by
+ * struct heap, and their index is kept up to date for removal and
+ * update.
+ *
+ * Authors: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#ifndef CKIT_KEYHEAP_H
+#define CKIT_KEYHEAP_H
+
+#include <stdint.h>
+#include <ckit/heap.h>
+
+/* Children per entry. Four 16-byte entries fill a cache line. */
+#define KEYHEAP_ARITY 4
+
+typedef struct keyheap_entry {
+    uint64_t key;
+    struct heapitem *item;
+} keyheap_entry_t;
+
+typedef struct keyheap {
+    unsigned int max_size;
+    unsigned int size;
+    struct keyheap_entry *map;
+    void *mem; /* Allocation holding map */
+} keyheap_t;
+
+int keyheap_init(struct keyheap *kh, unsigned int max_size);
+void keyheap_fini(struct keyheap *kh);
+
+/**
+ * Make room for at least 'size' items in total.
+ */
+int keyheap_reserve(struct keyheap *kh, unsigned int size);
+int keyheap_insert(struct keyheap *kh, struct heapitem *item, uint64_t key);
+
+/**
+ * Insert 'n' items with their keys at once. Large batches are
+ * appended and the heap rebuilt in linear time.
+ */
+int keyheap_insert_many(struct keyheap *kh,
+                        const struct keyheap_entry *entries, unsigned int n);
+struct heapitem *keyheap_remove(struct keyheap *kh, unsigned int index);
+
+/**
+ * Change the key of an item in the heap and move it to its new
+ * position.
+ */
+void keyheap_update(struct keyheap *kh, struct heapitem *item, uint64_t key);
+
+static inline int keyheap_empty(const struct keyheap *kh)
+{
+    return kh->size == 0;
+}
+
+static inline unsigned int keyheap_size(const struct keyheap *kh)
+{
+    return kh->size;
+}
+
+static inline struct heapitem *keyheap_front(const struct keyheap *kh)
+{
+    return kh->size ? kh->map[0].item : NULL;
+}
+
+/* The key of the first item. The heap must not be empty. */
+static inline uint64_t keyheap_front_key(const struct keyheap *kh)
+{
+    return kh->map[0].key;
+}
+
+/* The key of an item in the heap. */
+static inline uint64_t keyheap_key(const struct keyheap *kh,
+                                   const struct heapitem *item)
+{
+    return kh->map[item->index].key;
+}
+
+static inline struct heapitem *keyheap_remove_first(struct keyheap *kh)
+{
+    return keyheap_remove(kh, 0);
+}
+
+#define keyheap_first_entry(kh, type, member)       \
+    get_enclosing(keyheap_front(kh), type, member)
+
+#define keyheap_remove_first_entry(kh, type, member)        \
+    get_enclosing(keyheap_remove_first(kh), type, member)
+
+#endif /* CKIT_KEYHEAP_H */
@@ -8,6 +8,7 @@
 #define CKIT_LIST_H__
 
 #include <ckit/ckit.h>
+#include <ckit/atomic.h>
 
 typedef struct list {
     struct list *prev, *next;
@@ -52,6 +53,33 @@ static inline void list_del(struct list *to_del)
     to_del->next = to_del->prev = to_del;
 }
 
+/**
+ * Add element to front of a list that is concurrently traversed by
+ * lock-free readers. The element is fully linked before it is
+ * published.
+ */
+static inline void list_add_front_rcu(struct list *anchor,
+                                      struct list *to_add)
+{
+    to_add->next = anchor->next;
+    to_add->prev = anchor;
+    anchor->next->prev = to_add;
+    store_release(&anchor->next, to_add);
+}
+
+/**
+ * Delete an element from a list that is concurrently traversed by
+ * lock-free readers. The element's next pointer is left intact so
+ * that readers currently on it can continue; it must not be reused
+ * until those readers are done.
+ */
+static inline void list_del_rcu(struct list *to_del)
+{
+    to_del->prev->next = to_del->next;
+    to_del->next->prev = to_del->prev;
+    to_del->prev = to_del;
+}
+
 /**
  * Move element from one list to another.
  */
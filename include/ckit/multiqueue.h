@@ -0,0 +1,75 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Concurrent priority queue built from several keyed heaps, each
+ * with its own lock (a MultiQueue). Inserts go to a random heap, so
+ * producers rarely contend on the same lock. Pops are either relaxed,
+ * taking the smaller of the first items of two random heaps, or
+ * strict, taking the smallest of all heaps' first items.
+ *
+ * A relaxed pop returns one of the smallest items with high
+ * probability but not always the smallest one, which is typically
+ * fine for scheduling work or timers that are already due.
+ *
+ * Authors: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#ifndef CKIT_MULTIQUEUE_H
+#define CKIT_MULTIQUEUE_H
+
+#include <stdint.h>
+#include <ckit/keyheap.h>
+
+enum multiqueue_flag {
+    MULTIQUEUE_F_STRICT = 1 << 0, /* Always pop the smallest item */
+};
+
+/* Heaps per CPU when the number of heaps is not given. */
+#define MULTIQUEUE_HEAPS_PER_CPU 2
+
+struct multiqueue_heap {
+    unsigned int lock;
+    uint64_t min; /* First key, or UINT64_MAX if empty */
+    struct keyheap heap;
+} __attribute__((aligned(64)));
+
+typedef struct multiqueue {
+    unsigned int nheaps;
+    int flags;
+    struct multiqueue_heap *heaps;
+} multiqueue_t;
+
+/**
+ * Initialize a queue with 'nheaps' heaps, or a number based on the
+ * number of CPUs if zero.
+ */
+int multiqueue_init(struct multiqueue *mq, unsigned int nheaps, int flags);
+
+/**
+ * Free the heaps. Items still in the queue are left untouched.
+ */
+void multiqueue_fini(struct multiqueue *mq);
+
+/**
+ * Insert an item with the given key. May be called by any number of
+ * threads concurrently with each other and with pops.
+ */
+int multiqueue_insert(struct multiqueue *mq, struct heapitem *item,
+                      uint64_t key);
+
+/**
+ * Remove an item with a small key, or the smallest with
+ * MULTIQUEUE_F_STRICT, and optionally return its key. Returns NULL if
+ * the queue was found empty.
+ */
+struct heapitem *multiqueue_pop(struct multiqueue *mq, uint64_t *key);
+
+/**
+ * Get the smallest key in the queue without removing it. Returns -1
+ * if the queue is empty. The result may be stale by the time it is
+ * returned.
+ */
+int multiqueue_peek(struct multiqueue *mq, uint64_t *key);
+
+#define multiqueue_entry(ptr, type, member)     \
+    get_enclosing(ptr, type, member)
+
+#endif /* CKIT_MULTIQUEUE_H */
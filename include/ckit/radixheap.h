@@ -0,0 +1,78 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Radix heap for monotone integer keys, e.g., timer deadlines.
+ *
+ * A radix heap requires that no key smaller than the last removed
+ * minimum is inserted. Items are kept in 65 buckets by the highest
+ * bit in which their key differs from that minimum, and each item is
+ * only moved to a lower bucket as the minimum advances. Insert and
+ * remove are O(1), and removing the first item is amortized O(1) per
+ * bit of the key. Keys smaller than the last minimum are raised to
+ * it, so items inserted in the past come first, in insertion order.
+ *
+ * Items are intrusive like struct heapitem, and start with the same
+ * members.
+ *
+ * Authors: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#ifndef CKIT_RADIXHEAP_H
+#define CKIT_RADIXHEAP_H
+
+#include <stdint.h>
+#include <ckit/list.h>
+
+#define RADIXHEAP_BUCKETS 65
+
+typedef struct radixitem {
+    unsigned int bucket;
+    unsigned char active;
+    struct list lh;
+    uint64_t key; /* Possibly raised to the heap's last minimum */
+} radixitem_t;
+
+typedef struct radixheap {
+    unsigned int size;
+    uint64_t last; /* Last minimum */
+    uint64_t nonempty; /* Bit b - 1 set if bucket b has items */
+    struct radixitem *min; /* Cached by radixheap_front(), or NULL */
+    struct list buckets[RADIXHEAP_BUCKETS];
+} radixheap_t;
+
+void radixheap_init(struct radixheap *rh);
+void radixheap_insert(struct radixheap *rh, struct radixitem *item,
+                      uint64_t key);
+void radixheap_remove(struct radixheap *rh, struct radixitem *item);
+
+/**
+ * Change the key of an item in the heap.
+ */
+void radixheap_update(struct radixheap *rh, struct radixitem *item,
+                      uint64_t key);
+
+/**
+ * Get the item with the smallest key, or NULL if the heap is
+ * empty. Keys smaller than the returned one may still be inserted.
+ */
+struct radixitem *radixheap_front(struct radixheap *rh);
+
+/**
+ * Remove the item with the smallest key. Its key becomes the heap's
+ * last minimum, and smaller keys inserted afterwards are raised to
+ * it.
+ */
+struct radixitem *radixheap_remove_first(struct radixheap *rh);
+
+static inline int radixheap_empty(const struct radixheap *rh)
+{
+    return rh->size == 0;
+}
+
+static inline unsigned int radixheap_size(const struct radixheap *rh)
+{
+    return rh->size;
+}
+
+#define radixheap_entry(ptr, type, member)      \
+    get_enclosing(ptr, type, member)
+
+#endif /* CKIT_RADIXHEAP_H */
@@ -2,6 +2,7 @@
 #ifndef CKIT_TIME_H
 #define CKIT_TIME_H
 
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/time.h>
 
@@ -95,4 +96,39 @@
 #define timeval_eq(t1, t2) ((t1)->tv_sec == (t2)->tv_sec && \
                             (t1)->tv_usec == (t2)->tv_usec)
 
+enum ck_clock_source {
+    CK_CLOCK_MONOTONIC, /* clock_gettime() on CLOCK_MONOTONIC */
+    CK_CLOCK_COARSE, /* CLOCK_MONOTONIC_COARSE, only as fine as the
+                      * kernel's tick */
+    CK_CLOCK_CACHED, /* The time of the last ck_now_update() */
+    CK_CLOCK_TSC, /* The CPU's invariant time stamp counter */
+};
+
+/**
+ * Select the source of ck_now_ns() for the calling thread. All
+ * sources count nanoseconds on the CLOCK_MONOTONIC timebase. The
+ * default is CK_CLOCK_MONOTONIC. CK_CLOCK_CACHED suits an event loop
+ * thread that calls ck_now_update() once per iteration, after which
+ * reading the time is free but may lag by up to an iteration.
+ * CK_CLOCK_TSC is calibrated against CLOCK_MONOTONIC when first
+ * selected. Returns -1, leaving the source unchanged, if the source
+ * is not available, e.g., without an invariant TSC or on other
+ * architectures than x86-64.
+ */
+int ck_clock_set_source(enum ck_clock_source source);
+enum ck_clock_source ck_clock_get_source(void);
+
+/**
+ * Get the current time in nanoseconds from the calling thread's
+ * clock source.
+ */
+uint64_t ck_now_ns(void);
+
+/**
+ * Read the time precisely, with the TSC if that is the source and
+ * with CLOCK_MONOTONIC otherwise, and make it the cached time that
+ * CK_CLOCK_CACHED returns. Returns the time read.
+ */
+uint64_t ck_now_update(void);
+
 #endif /* CKIT_TIME_H */
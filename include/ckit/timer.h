@@ -9,33 +9,93 @@
 
 #include <ckit/signal.h>
 #include <ckit/time.h>
-#include <ckit/heap.h>
+#include <ckit/list.h>
+#include <ckit/keyheap.h>
+#include <ckit/radixheap.h>
+#include <ckit/timerwheel.h>
 #include <pthread.h>
 
 struct timer {
-    struct heapitem hi;
+    /* Both items start with the same members, so hi.active tells
+     * whether the timer is scheduled whatever the backend */
+    union {
+        struct heapitem hi;
+        struct radixitem ri;
+        struct wheelitem wi;
+    };
     struct timespec timeout;
     long expires; /* micro seconds */
+    long slack; /* micro seconds, 0 for the queue's */
+    long interval; /* micro seconds, periodic if non-zero */
     void (*callback)(struct timer *t);
     void (*destruct)(struct timer *t);
     void *data;        
+    struct list el; /* On the expired list until the callback runs */
+    /* Operation submitted by another thread than the owner of the
+     * queue, see timer_queue_set_owner() */
+    struct timer *next_op; /* In the queue's inbox */
+    int op;
+    long op_expires;
+    uint64_t op_deadline; /* In nanoseconds */
 };
 
+/* Slack of a timer that must not be delayed by the queue's slack. Any
+ * negative slack has the same effect. */
+#define TIMER_NO_SLACK -1
+
+enum timer_backend {
+    TIMER_BACKEND_HEAP, /* Keyed 4-ary heap */
+    TIMER_BACKEND_RADIX, /* Radix heap, see ckit/radixheap.h */
+    TIMER_BACKEND_WHEEL, /* Timing wheel, see ckit/timerwheel.h */
+};
+
+/* Tick of a timing wheel queue unless given, in micro seconds */
+#define TIMER_WHEEL_DEFAULT_TICK 1000
+
 struct timer_queue {
-    struct heap queue;
+    enum timer_backend backend;
+    union {
+        struct keyheap queue;
+        struct radixheap radix;
+        struct timerwheel wheel;
+    };
     pthread_mutex_t lock;
     struct signal signal;
+    int timerfd; /* Used instead of the signal if not -1 */
+    uint64_t armed; /* Deadline the main thread waits for, or 0 */
+    int raised; /* Timerfd armed to wake the main thread */
+    struct list expired; /* Timers whose callbacks are about to run */
+    uint64_t slack; /* Default timer slack in nanoseconds */
+    int owned; /* Only used by thr, others submit through the inbox */
+    struct timer *inbox; /* Timers with pending operations, LIFO */
     pthread_t thr;
 };
 
 #define TIMER_CALLBACK(t, cb) struct timer t = {    \
-        .lh = { &t.lh, &t.lh },                     \
         .expires = 0,                               \
         .callback = cb,                             \
         .destruct = NULL,                           \
         .data = NULL                                \
     }
 #define TIMER(t) TIMER_CALLBACK(t, NULL)
+#define TIMER_PERIODIC(t, cb, usecs) struct timer t = { \
+        .expires = usecs,                               \
+        .interval = usecs,                              \
+        .callback = cb,                                 \
+        .destruct = NULL,                               \
+        .data = NULL                                    \
+    }
+
+/*
+ * A fixed number of timers allocated up front, for creating timers
+ * without allocating memory.
+ */
+struct timer_pool {
+    pthread_mutex_t lock;
+    struct timer *timers;
+    unsigned int size;
+    struct list free;
+};
 
 enum signal_result {
     TIMER_SIGNAL_ERROR = -1,
@@ -48,6 +108,8 @@ void timer_init(struct timer *t);
 struct timer *timer_new_callback(void (*callback)(struct timer *t), void *data);
 void timer_free(struct timer *t);
 int timer_add(struct timer_queue *tq, struct timer *t);
+int timer_add_many(struct timer_queue *tq, struct timer **timers,
+                   unsigned int n);
 int timer_mod(struct timer_queue *tq, struct timer *t, unsigned long expires);
 void timer_del(struct timer_queue *tq, struct timer *t);
 int timer_next_timeout(struct timer_queue *tq, unsigned long *timeout);
@@ -55,14 +117,119 @@ int timer_next_timeout_timespec(struct timer_queue *tq,
                                 struct timespec *timeout);
 int timer_next_timeout_timeval(struct timer_queue *tq, 
                                struct timeval *timeout);
+
+/**
+ * Take the first timer off the queue and run its callback, after
+ * waiting for the timeout given by timer_next_timeout(). A periodic
+ * timer is moved to its next period instead, but only once due.
+ * Returns -1 if no timer was handled.
+ */
 int timer_handle_timeout(struct timer_queue *tq);
+
+/**
+ * Run the callbacks of all timers that have expired, reading the
+ * clock once and removing them from the queue under a single lock
+ * acquisition. The callbacks run without the lock held, in order of
+ * expiry. A timer that is deleted or rescheduled by an earlier
+ * callback does not run. A non-zero 'budget' caps the number of
+ * timers handled, to bound the time spent in one call. Returns the
+ * number of callbacks run.
+ */
+int timer_handle_expired(struct timer_queue *tq, unsigned int budget);
 int timer_queue_get_signal(struct timer_queue *tq);
 int timer_queue_signal_raise(struct timer_queue *tq);
 enum signal_result timer_queue_signal_lower(struct timer_queue *tq);
 void timer_queue_destroy(struct timer_queue *tq);
 int timer_queue_init(struct timer_queue *tq);
+
+/**
+ * Initialize a timer queue with the given backend. The radix heap
+ * gives O(1) inserts and removals and amortized O(1) expiry. It
+ * relies on expired deadlines never decreasing, so a timer that is
+ * scheduled to expire before the last handled one is treated as due
+ * at that timer's deadline. Adding and deleting timers never looks up
+ * the first timer, which with the radix heap and the timing wheel may
+ * scan many timers, so that is only done when the main thread asks
+ * for the next timeout or handles expired timers.
+ */
+int timer_queue_init_backend(struct timer_queue *tq,
+                             enum timer_backend backend);
+
+/**
+ * Initialize a timer queue backed by a hierarchical timing wheel with
+ * the given tick in micro seconds. Adding and deleting timers is
+ * O(1), which suits large numbers of timers that are mostly deleted
+ * before they expire. Timers expiring within the same tick may be
+ * handled in any order.
+ */
+int timer_queue_init_wheel(struct timer_queue *tq, unsigned long tick);
+
+/**
+ * Replace the queue's pipe signal with a timerfd armed for the first
+ * timer's absolute deadline on CLOCK_MONOTONIC. The timerfd is
+ * returned by timer_queue_get_signal() and becomes readable once the
+ * first timer expires, so an event loop can wait on it without a
+ * timeout. It is reprogrammed from whichever thread schedules a timer
+ * before the deadline it is armed for. Deleting that timer leaves the
+ * timerfd armed, so it may expire early, in which case handling
+ * expired timers rearms it for the new first timer. Call right after
+ * initializing the queue. Linux only; returns -1 elsewhere.
+ */
+int timer_queue_use_timerfd(struct timer_queue *tq);
+
+/**
+ * Set the default slack of the queue's timers, in micro seconds.
+ * Deadlines are rounded up to a multiple of the slack, so a timer
+ * may expire up to that much late, but timers due close together
+ * expire at the same time and are handled in one wakeup. A timer's
+ * own slack, if set, is used instead. Applies to timers added or
+ * modified after the call.
+ */
+void timer_queue_set_slack(struct timer_queue *tq, unsigned long slack);
+
+/**
+ * Make the calling thread the queue's owner, which then uses the
+ * queue without locking. Other threads' timer_add(), timer_mod() and
+ * timer_del() calls are not applied directly but pushed onto a
+ * lock-free inbox, and the owner is woken up through the queue's
+ * signal once per batch, when the inbox goes from empty to non-empty.
+ * The owner applies the operations in the order they were submitted
+ * when it next uses the queue, or by calling timer_queue_drain().
+ * All other functions must only be called by the owner. A timer must
+ * not be submitted by several threads concurrently. Call right after
+ * initializing the queue.
+ */
+void timer_queue_set_owner(struct timer_queue *tq);
+
+/**
+ * Apply the operations other threads submitted to an owned queue.
+ * Called by the owner, typically once per event loop iteration before
+ * waiting. Returns the number of operations applied.
+ */
+int timer_queue_drain(struct timer_queue *tq);
 void timer_queue_fini(struct timer_queue *tq);
 
+/**
+ * Allocate a pool of 'size' timers.
+ */
+int timer_pool_init(struct timer_pool *pool, unsigned int size);
+
+/**
+ * Free the pool's timers, which must all be off their queues.
+ */
+void timer_pool_fini(struct timer_pool *pool);
+
+/**
+ * Get an initialized timer from the pool, or NULL if all are in use.
+ */
+struct timer *timer_pool_get(struct timer_pool *pool,
+                             void (*callback)(struct timer *t), void *data);
+
+/**
+ * Return a timer to its pool. The timer must not be scheduled.
+ */
+void timer_pool_put(struct timer_pool *pool, struct timer *t);
+
 #define timer_new() timer_new_callback(NULL, NULL
 #define timer_secs(s) (s * 1000000L)
 #define timer_msecs(s) (s * 1000L)
@@ -70,6 +237,13 @@ void timer_queue_fini(struct timer_queue *tq);
 #define timer_set_secs(t, s) { (t)->expires = timer_secs(s); }
 #define timer_set_msecs(t, s) { (t)->expires = timer_msecs(s); }
 #define timer_set_usecs(t, s) { (t)->expires = s; }
+#define timer_set_slack(t, s) { (t)->slack = s; }
+/* Make the timer expire every 's' micro seconds once added. Each
+ * deadline is the previous one plus the interval, so expiries do not
+ * drift, and periods missed while the queue was not handled are
+ * skipped. The timer stays scheduled while its callback runs, and is
+ * stopped with timer_del(). */
+#define timer_set_periodic(t, s) { (t)->expires = (t)->interval = s; }
 #define timer_schedule_secs(tq, t, s) ({ int ret;   \
             timer_set_secs(t, s);                   \
             ret = timer_add(tq, t);                 \
@@ -78,7 +252,7 @@ void timer_queue_fini(struct timer_queue *tq);
             timer_set_msecs(t, s);                  \
             ret = timer_add(tq, t);                 \
             ret; })
-#define timer_scheduled(t) (t->hi.active)
+#define timer_scheduled(t) ((t)->hi.active)
 #define timer_destroy(t) { if ((t)->destruct) (t)->destruct(t); }
 
 #endif /* CKIT_TIMER_H */
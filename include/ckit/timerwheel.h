@@ -0,0 +1,87 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Hierarchical timing wheel.
+ *
+ * Time is counted in ticks of a configurable length. Each wheel has
+ * 64 slots and covers 64 times the span of the wheel below it. An
+ * item is kept in the lowest wheel whose span covers its expiry, and
+ * is cascaded to finer wheels as time approaches it, until it lands
+ * in the finest wheel where each slot is a single tick. Adding and
+ * cancelling items is O(1), and each item is cascaded at most once
+ * per wheel.
+ *
+ * Time advances as items are removed in expiry order, so, like a
+ * radix heap, items must not be added to expire before the last
+ * removed one. Such items are treated as expiring at that tick.
+ * Items with the same tick are removed in no particular order.
+ *
+ * Items are intrusive like struct heapitem, and start with the same
+ * members.
+ *
+ * Authors: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#ifndef CKIT_TIMERWHEEL_H
+#define CKIT_TIMERWHEEL_H
+
+#include <stdint.h>
+#include <ckit/list.h>
+
+#define TIMERWHEEL_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_BITS)
+#define TIMERWHEEL_LEVELS ((64 + TIMERWHEEL_BITS - 1) / TIMERWHEEL_BITS)
+
+typedef struct wheelitem {
+    unsigned int slot; /* Index into all wheels' slots */
+    unsigned char active;
+    struct list lh;
+    uint64_t tick; /* Of expiry */
+} wheelitem_t;
+
+typedef struct timerwheel {
+    unsigned int size;
+    uint64_t tick_ns; /* Length of a tick */
+    uint64_t now; /* Tick of the last removed item */
+    struct wheelitem *min; /* Cached by timerwheel_front(), or NULL */
+    uint64_t occupied[TIMERWHEEL_LEVELS]; /* Non-empty slots per wheel */
+    struct list slots[TIMERWHEEL_LEVELS * TIMERWHEEL_SLOTS];
+} timerwheel_t;
+
+/**
+ * Initialize a timing wheel with ticks of the given length in
+ * nanoseconds.
+ */
+void timerwheel_init(struct timerwheel *tw, uint64_t tick_ns);
+
+/**
+ * Add an item expiring at the given time in nanoseconds, which is
+ * rounded up to a whole tick.
+ */
+void timerwheel_add(struct timerwheel *tw, struct wheelitem *item,
+                    uint64_t expires_ns);
+void timerwheel_del(struct timerwheel *tw, struct wheelitem *item);
+
+/**
+ * Get the item that expires first, or NULL if there are no items.
+ */
+struct wheelitem *timerwheel_front(struct timerwheel *tw);
+
+/**
+ * Remove the item that expires first, advancing the wheel's time to
+ * its tick.
+ */
+struct wheelitem *timerwheel_remove_first(struct timerwheel *tw);
+
+static inline int timerwheel_empty(const struct timerwheel *tw)
+{
+    return tw->size == 0;
+}
+
+static inline unsigned int timerwheel_size(const struct timerwheel *tw)
+{
+    return tw->size;
+}
+
+#define timerwheel_entry(ptr, type, member)     \
+    get_enclosing(ptr, type, member)
+
+#endif /* CKIT_TIMERWHEEL_H */
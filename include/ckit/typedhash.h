@@ -0,0 +1,207 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Type-specialized hash tables generated by a macro.
+ *
+ * CK_HASHTABLE_DEFINE(name, key_type, hashfn, equalfn) defines a
+ * table type 'struct name' and an element type 'struct name_elm'
+ * that holds a chain link, the key's hash and the key itself, by
+ * value. The hash and equality functions are called directly, as
+ * hashfn(const key_type *, uint64_t seed) and equalfn(const key_type *,
+ * const key_type *), so they can be macros or inline functions that
+ * the compiler specializes into each probe. The hash function should
+ * hash the key with the table's random seed, e.g., with
+ * hash_bytes_seed(), so that colliding keys cannot be precomputed.
+ *
+ * Elements are embedded in the caller's structures:
+ *
+ *   CK_HASHTABLE_DEFINE(flowtab, struct flowkey, flowkey_hash,
+ *                       flowkey_equal)
+ *
+ *   struct flow {
+ *       struct flowtab_elm elm;
+ *       ...
+ *   };
+ *
+ *   flow->elm.key = key;
+ *   flowtab_insert(&table, &flow->elm);
+ *   elm = flowtab_lookup(&table, &key);
+ *   flow = typedhash_entry(elm, struct flow, elm);
+ *
+ * Unlike struct hashtable, generated tables are not thread-safe and
+ * do not reference count their elements.
+ *
+ * Authors: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#ifndef CKIT_TYPEDHASH_H
+#define CKIT_TYPEDHASH_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <ckit/ckit.h>
+#include <ckit/hash.h>
+
+#define TYPEDHASH_MIN_SIZE 16
+
+#define typedhash_entry(ptr, type, member)      \
+    get_enclosing(ptr, type, member)
+
+#define CK_HASHTABLE_DEFINE(name, key_type, hashfn, equalfn)            \
+                                                                        \
+    struct name##_elm {                                                 \
+        struct name##_elm *next;                                        \
+        unsigned int hash;                                              \
+        key_type key;                                                   \
+    };                                                                  \
+                                                                        \
+    struct name {                                                       \
+        struct name##_elm **slots;                                      \
+        unsigned int mask;                                              \
+        unsigned int count;                                             \
+        uint64_t seed;                                                  \
+    };                                                                  \
+                                                                        \
+    static inline unsigned int name##_hashkey(const struct name *t,     \
+                                              const key_type *key)      \
+    {                                                                   \
+        return hashfn(key, t->seed);                                    \
+    }                                                                   \
+                                                                        \
+    static inline int name##_init(struct name *t, unsigned int size)    \
+    {                                                                   \
+        unsigned int n = TYPEDHASH_MIN_SIZE;                            \
+                                                                        \
+        while (n < size)                                                \
+            n <<= 1;                                                    \
+                                                                        \
+        t->slots = (struct name##_elm **)calloc(n, sizeof(*t->slots));  \
+                                                                        \
+        if (!t->slots)                                                  \
+            return -1;                                                  \
+                                                                        \
+        t->mask = n - 1;                                                \
+        t->count = 0;                                                   \
+        t->seed = hash_random_seed();                                   \
+        return 0;                                                       \
+    }                                                                   \
+                                                                        \
+    /* Elements are owned by the caller and not touched. */             \
+    static inline void name##_fini(struct name *t)                      \
+    {                                                                   \
+        free(t->slots);                                                 \
+        t->slots = NULL;                                                \
+        t->count = 0;                                                   \
+    }                                                                   \
+                                                                        \
+    static inline unsigned int name##_count(const struct name *t)       \
+    {                                                                   \
+        return t->count;                                                \
+    }                                                                   \
+                                                                        \
+    /* Lookup with a precomputed hash of the key. */                    \
+    static inline struct name##_elm *name##_lookup_hash(const struct name *t, \
+                                                        const key_type *key, \
+                                                        unsigned int hash) \
+    {                                                                   \
+        struct name##_elm *e = t->slots[hash & t->mask];                \
+                                                                        \
+        for (; e; e = e->next) {                                        \
+            if (e->hash == hash && equalfn(&e->key, key))               \
+                return e;                                               \
+        }                                                               \
+        return NULL;                                                    \
+    }                                                                   \
+                                                                        \
+    static inline struct name##_elm *name##_lookup(const struct name *t, \
+                                                   const key_type *key) \
+    {                                                                   \
+        return name##_lookup_hash(t, key, name##_hashkey(t, key));      \
+    }                                                                   \
+                                                                        \
+    /* Double the number of slots, reusing the stored hashes. */        \
+    static inline int name##_grow(struct name *t)                       \
+    {                                                                   \
+        unsigned int i, mask = (t->mask << 1) | 1;                      \
+        struct name##_elm **slots;                                      \
+                                                                        \
+        slots = (struct name##_elm **)calloc(mask + 1, sizeof(*slots)); \
+                                                                        \
+        if (!slots)                                                     \
+            return -1;                                                  \
+                                                                        \
+        for (i = 0; i <= t->mask; i++) {                                \
+            struct name##_elm *e = t->slots[i], *next;                  \
+                                                                        \
+            for (; e; e = next) {                                       \
+                next = e->next;                                         \
+                e->next = slots[e->hash & mask];                        \
+                slots[e->hash & mask] = e;                              \
+            }                                                           \
+        }                                                               \
+        free(t->slots);                                                 \
+        t->slots = slots;                                               \
+        t->mask = mask;                                                 \
+        return 0;                                                       \
+    }                                                                   \
+                                                                        \
+    /* Insert an element with its key set. Returns -1 if the key */     \
+    /* already exists. */                                               \
+    static inline int name##_insert(struct name *t, struct name##_elm *elm) \
+    {                                                                   \
+        unsigned int hash = name##_hashkey(t, &elm->key);               \
+        struct name##_elm **slot;                                       \
+                                                                        \
+        if (name##_lookup_hash(t, &elm->key, hash))                     \
+            return -1;                                                  \
+                                                                        \
+        /* A failed grow only makes chains longer */                    \
+        if (t->count > t->mask)                                         \
+            name##_grow(t);                                             \
+                                                                        \
+        elm->hash = hash;                                               \
+        slot = &t->slots[elm->hash & t->mask];                          \
+        elm->next = *slot;                                              \
+        *slot = elm;                                                    \
+        t->count++;                                                     \
+        return 0;                                                       \
+    }                                                                   \
+                                                                        \
+    /* Remove the element stored under the given key and return it. */ \
+    static inline struct name##_elm *name##_remove(struct name *t,      \
+                                                   const key_type *key) \
+    {                                                                   \
+        unsigned int hash = name##_hashkey(t, key);                     \
+        struct name##_elm **p = &t->slots[hash & t->mask], *e;          \
+                                                                        \
+        for (; (e = *p) != NULL; p = &e->next) {                        \
+            if (e->hash == hash && equalfn(&e->key, key)) {             \
+                *p = e->next;                                           \
+                e->next = NULL;                                         \
+                t->count--;                                             \
+                return e;                                               \
+            }                                                           \
+        }                                                               \
+        return NULL;                                                    \
+    }                                                                   \
+                                                                        \
+    /* Apply a function to every element. The function may remove */   \
+    /* the element it is called on. */                                  \
+    static inline unsigned int name##_foreach(struct name *t,           \
+                                              void (*action)(struct name##_elm *, \
+                                                             void *),   \
+                                              void *data)               \
+    {                                                                   \
+        unsigned int i, n = 0;                                          \
+                                                                        \
+        for (i = 0; i <= t->mask; i++) {                                \
+            struct name##_elm *e = t->slots[i], *next;                  \
+                                                                        \
+            for (; e; e = next) {                                       \
+                next = e->next;                                         \
+                action(e, data);                                        \
+                n++;                                                    \
+            }                                                           \
+        }                                                               \
+        return n;                                                       \
+    }
+
+#endif /* CKIT_TYPEDHASH_H */
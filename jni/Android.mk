@@ -3,27 +3,48 @@ LOCAL_PATH := $(my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_HDR_FILES := \
+	../include/ckit/cache.h \
 	../include/ckit/debug.h \
+	../include/ckit/epoch.h \
 	../include/ckit/event.h \
+	../include/ckit/flathash.h \
 	../include/ckit/heap.h \
+	../include/ckit/keyheap.h \
 	../include/ckit/timer.h \
+	../include/ckit/timerwheel.h \
 	../include/ckit/signal.h \
 	../include/ckit/list.h \
 	../include/ckit/log.h \
+	../include/ckit/multiqueue.h \
 	../include/ckit/hash.h \
+	../include/ckit/hashfrozen.h \
+	../include/ckit/hashsnap.h \
 	../include/ckit/hashtable.h \
 	../include/ckit/pbuf.h \
-	../include/ckit/rbtree.h 
+	../include/ckit/radixheap.h \
+	../include/ckit/rbtree.h \
+	../include/ckit/typedhash.h
 
 LOCAL_SRC_FILES := \
 	../src/event_epoll.c \
+	../src/cache.c \
 	../src/debug.c \
+	../src/epoch.c \
+	../src/flathash.c \
+	../src/hash.c \
+	../src/hashfrozen.c \
+	../src/hashsnap.c \
 	../src/log.c \
+	../src/multiqueue.c \
 	../src/heap.c \
+	../src/keyheap.c \
 	../src/signal.c \
+	../src/time.c \
 	../src/timer.c \
+	../src/timerwheel.c \
 	../src/rbtree.c \
 	../src/pbuf.c \
+	../src/radixheap.c \
 	../src/hashtable.c
 
 LOCAL_C_INCLUDES += \
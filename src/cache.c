@@ -0,0 +1,358 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * A bounded cache built on the hash table and timer queue.
+ *
+ * The CLOCK ring and the SLRU segments are lists ordered from the
+ * eviction end (front) to the most recently added entry (back). An
+ * eviction scan pops entries from the front, moving those whose
+ * reference bit is set to the back (CLOCK) or to the protected
+ * segment (SLRU) instead of evicting them. Lookups only ever set the
+ * reference bit, so hits never touch the lists or the cache lock.
+ *
+ * Author: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <ckit/cache.h>
+#include <ckit/time.h>
+
+/* Percentage of the budget the SLRU protected segment may use. */
+#define CACHE_PROTECTED_SHARE 80
+
+/* Maximum number of entries checked by one run of the expiry
+ * sweep. */
+#define CACHE_SWEEP_MAX 64
+
+static inline struct cache *hashtable_cache(struct hashtable *ht)
+{
+    return get_enclosing(ht, struct cache, ht);
+}
+
+static int cache_equal(const struct hashelm *he, const void *key)
+{
+    struct cache *c = hashtable_cache(he->ht);
+
+    return c->equalfn(cache_entry(he, struct cache_entry, he), key);
+}
+
+static void cache_free(struct hashelm *he)
+{
+    struct cache *c = hashtable_cache(he->ht);
+
+    if (c->freefn)
+        c->freefn(cache_entry(he, struct cache_entry, he));
+}
+
+int cache_init(struct cache *c, cache_policy_t policy,
+               unsigned long max_entries, unsigned long max_bytes,
+               cache_hashfn_t hashfn, cache_equalfn_t equalfn,
+               cache_freefn_t freefn)
+{
+    memset(c, 0, sizeof(*c));
+
+    /* Hits walk the table without locks */
+    if (hashtable_init_flags(&c->ht, max_entries, hashfn, cache_equal,
+                             cache_free, HTABLE_F_RCU))
+        return -1;
+
+    pthread_mutex_init(&c->lock, NULL);
+    c->policy = policy;
+    INIT_LIST(&c->probation);
+    INIT_LIST(&c->protected);
+    INIT_LIST(&c->expiry);
+    c->max_entries = max_entries;
+    c->max_bytes = max_bytes;
+    c->equalfn = equalfn;
+    c->freefn = freefn;
+
+    return 0;
+}
+
+void cache_entry_init(struct cache_entry *ce)
+{
+    hashelm_init(&ce->he);
+    INIT_LIST(&ce->lru);
+    INIT_LIST(&ce->exp);
+    ce->size = 0;
+    ce->expires = 0;
+    ce->ref = 0;
+    ce->protected = 0;
+    ce->cached = 0;
+}
+
+/*
+  Take an entry off the cache's lists. Must be called with the cache
+  lock held.
+*/
+static void cache_detach(struct cache *c, struct cache_entry *ce)
+{
+    list_del(&ce->lru);
+    list_del(&ce->exp);
+
+    if (ce->protected) {
+        c->protected_entries--;
+        c->protected_bytes -= ce->size;
+        ce->protected = 0;
+    }
+    c->entries--;
+    c->bytes -= ce->size;
+    ce->cached = 0;
+}
+
+/*
+  Take an entry out of the cache, dropping the cache's reference. Must
+  be called with the cache lock held.
+*/
+static void cache_unlink(struct cache *c, struct cache_entry *ce)
+{
+    cache_detach(c, ce);
+    hashtable_unhash(&c->ht, &ce->he);
+}
+
+static int cache_over_budget(struct cache *c)
+{
+    return (c->max_entries && c->entries > c->max_entries) ||
+        (c->max_bytes && c->bytes > c->max_bytes);
+}
+
+static int cache_protected_full(struct cache *c)
+{
+    return (c->max_entries && c->protected_entries >
+            c->max_entries * CACHE_PROTECTED_SHARE / 100) ||
+        (c->max_bytes && c->protected_bytes >
+         c->max_bytes * CACHE_PROTECTED_SHARE / 100);
+}
+
+static void cache_protect(struct cache *c, struct cache_entry *ce)
+{
+    list_del(&ce->lru);
+    list_add_back(&c->protected, &ce->lru);
+    ce->protected = 1;
+    c->protected_entries++;
+    c->protected_bytes += ce->size;
+}
+
+static void cache_demote(struct cache *c, struct cache_entry *ce)
+{
+    list_del(&ce->lru);
+    list_add_back(&c->probation, &ce->lru);
+    ce->protected = 0;
+    c->protected_entries--;
+    c->protected_bytes -= ce->size;
+}
+
+/*
+  Evict entries until the cache is within its budget. Must be called
+  with the cache lock held. Entries that keep being hit while the
+  scan runs only get a bounded number of second chances.
+*/
+static void cache_evict(struct cache *c)
+{
+    unsigned long chances = 2 * c->entries;
+
+    while (cache_over_budget(c)) {
+        struct cache_entry *ce;
+
+        if (c->policy == CACHE_SLRU &&
+            (list_empty(&c->probation) || cache_protected_full(c))) {
+            ce = list_front(&c->protected, struct cache_entry, lru);
+
+            if (ce->ref && chances > 0) {
+                ce->ref = 0;
+                list_del(&ce->lru);
+                list_add_back(&c->protected, &ce->lru);
+                chances--;
+                continue;
+            }
+            ce->ref = 0;
+            cache_demote(c, ce);
+            continue;
+        }
+
+        ce = list_front(&c->probation, struct cache_entry, lru);
+
+        if (ce->ref && chances > 0) {
+            ce->ref = 0;
+            chances--;
+
+            if (c->policy == CACHE_SLRU) {
+                cache_protect(c, ce);
+            } else {
+                list_del(&ce->lru);
+                list_add_back(&c->probation, &ce->lru);
+            }
+            continue;
+        }
+        cache_unlink(c, ce);
+    }
+}
+
+int cache_insert(struct cache *c, struct cache_entry *ce, const void *key,
+                 unsigned long size, unsigned long ttl)
+{
+    struct hashelm *he;
+
+    if (c->max_bytes && size > c->max_bytes)
+        return -1;
+
+    /* A re-inserted entry may have to wait for readers of its removal
+     * to leave, which must not hold up other cache users */
+    if (hashelm_wait_grace(&ce->he))
+        return -1;
+
+    pthread_mutex_lock(&c->lock);
+
+    if (hashtable_replace(&c->ht, &ce->he, key, &he)) {
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+
+    if (he) {
+        struct cache_entry *old = cache_entry(he, struct cache_entry, he);
+
+        if (old->cached)
+            cache_detach(c, old);
+
+        hashelm_put(he);
+    }
+
+    ce->size = size;
+    ce->ref = 0;
+    ce->protected = 0;
+    ce->cached = 1;
+    ce->expires = ttl ? ck_now_ns() + (uint64_t)ttl * NSEC_PER_USEC : 0;
+    list_add_back(&c->probation, &ce->lru);
+
+    if (ce->expires)
+        list_add_back(&c->expiry, &ce->exp);
+
+    c->entries++;
+    c->bytes += size;
+
+    cache_evict(c);
+
+    pthread_mutex_unlock(&c->lock);
+
+    return 0;
+}
+
+void cache_remove(struct cache *c, struct cache_entry *ce)
+{
+    pthread_mutex_lock(&c->lock);
+
+    if (ce->cached)
+        cache_unlink(c, ce);
+
+    pthread_mutex_unlock(&c->lock);
+}
+
+struct cache_entry *cache_lookup(struct cache *c, const void *key)
+{
+    struct hashelm *he = hashtable_lookup(&c->ht, key);
+    struct cache_entry *ce;
+
+    if (!he)
+        return NULL;
+
+    ce = cache_entry(he, struct cache_entry, he);
+
+    if (ce->expires && ce->expires <= ck_now_ns()) {
+        cache_remove(c, ce);
+        cache_entry_put(ce);
+        return NULL;
+    }
+
+    /* Avoid dirtying the entry's cache line on repeated hits. A racy
+     * update only gives or takes one second chance */
+    if (!ce->ref)
+        ce->ref = 1;
+
+    return ce;
+}
+
+static void cache_sweep(struct timer *t)
+{
+    struct cache *c = t->data;
+    uint64_t now = ck_now_ns();
+    unsigned int n = CACHE_SWEEP_MAX;
+
+    pthread_mutex_lock(&c->lock);
+
+    /* Expiry list order is insertion order, so entries that have not
+     * expired are rotated to the back to let the next run check
+     * others */
+    while (n-- > 0 && !list_empty(&c->expiry)) {
+        struct cache_entry *ce;
+
+        ce = list_front(&c->expiry, struct cache_entry, exp);
+
+        if (ce->expires <= now) {
+            cache_unlink(c, ce);
+        } else {
+            list_del(&ce->exp);
+            list_add_back(&c->expiry, &ce->exp);
+        }
+    }
+
+    if (c->tq)
+        timer_add(c->tq, t);
+
+    pthread_mutex_unlock(&c->lock);
+}
+
+int cache_start_expiry(struct cache *c, struct timer_queue *tq,
+                       unsigned long interval)
+{
+    int ret;
+
+    pthread_mutex_lock(&c->lock);
+
+    if (c->tq) {
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+
+    timer_init(&c->sweep);
+    c->sweep.callback = cache_sweep;
+    c->sweep.data = c;
+    timer_set_usecs(&c->sweep, interval);
+    c->tq = tq;
+    ret = timer_add(tq, &c->sweep);
+
+    if (ret == -1)
+        c->tq = NULL;
+
+    pthread_mutex_unlock(&c->lock);
+
+    return ret == -1 ? -1 : 0;
+}
+
+void cache_stop_expiry(struct cache *c)
+{
+    struct timer *t = &c->sweep;
+
+    pthread_mutex_lock(&c->lock);
+
+    if (c->tq && timer_scheduled(t))
+        timer_del(c->tq, t);
+
+    c->tq = NULL;
+
+    pthread_mutex_unlock(&c->lock);
+}
+
+void cache_fini(struct cache *c)
+{
+    pthread_mutex_lock(&c->lock);
+
+    while (!list_empty(&c->probation))
+        cache_unlink(c, list_front(&c->probation, struct cache_entry, lru));
+
+    while (!list_empty(&c->protected))
+        cache_unlink(c, list_front(&c->protected, struct cache_entry, lru));
+
+    pthread_mutex_unlock(&c->lock);
+
+    hashtable_fini(&c->ht);
+    pthread_mutex_destroy(&c->lock);
+}
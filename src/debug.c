@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/time.h>
 #include <ckit/debug.h>
 #include <ckit/log.h>
 #if defined(ANDROID)
@@ -48,12 +49,17 @@ int ck_dbg_open(struct ck_dbg *dbg, const char *path)
 	ret = ck_log_open(&dbg->log, path, CK_LOG_APPEND);
 
 	if (ret == 0) {
-		struct timeval now;
-		gettimeofday(&now, NULL);
+		/* Log lines are stamped with monotonic time, so give the
+		 * wall clock time it corresponds to */
+		uint64_t now = ck_now_ns();
+		struct timeval wall;
+		gettimeofday(&wall, NULL);
 		ck_dbg_print(dbg, LOG_LVL_INF, 
-					 "START", "%ld.%06ld %-4s %s\n",
-					 (long)now.tv_sec, (long)now.tv_usec, "INF",
-					 "<<<<<< Log start >>>>>>");
+					 "START", "%ld.%06ld %-4s %s (wall clock %ld.%06ld)\n",
+					 (long)(now / NSEC_PER_SEC),
+					 (long)(now % NSEC_PER_SEC / NSEC_PER_USEC), "INF",
+					 "<<<<<< Log start >>>>>>",
+					 (long)wall.tv_sec, (long)wall.tv_usec);
 	}
 	return ret;
 }
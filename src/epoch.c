@@ -0,0 +1,189 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Epoch-based memory reclamation.
+ *
+ * Every thread that enters a read-side section announces the global
+ * epoch it observed. The global epoch can only be advanced once all
+ * threads inside a section have observed the current one. An object
+ * deferred in epoch E can therefore be freed once the global epoch
+ * has reached E + 2, since no reader can then still hold a reference
+ * obtained before the object was unlinked.
+ *
+ * Author: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <ckit/epoch.h>
+#include <ckit/atomic.h>
+
+/* Deferred entries are kept on one list per epoch modulo three; when
+ * the epoch advances to E, the list for E - 2 is safe to reclaim. */
+#define EPOCH_NUM_LISTS 3
+
+/* Try to advance the epoch every this many deferred entries. */
+#define EPOCH_POLL_INTERVAL 64
+
+struct epoch_record {
+    struct epoch_record *next;
+    unsigned long epoch;
+    unsigned int nesting;
+    int registered;
+};
+
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t epoch_key;
+static struct epoch_record *records;
+static struct epoch_entry *limbo[EPOCH_NUM_LISTS];
+static unsigned long global_epoch;
+static unsigned long num_deferred;
+static __thread struct epoch_record thread_record;
+
+static void epoch_unregister(void *arg)
+{
+    struct epoch_record *rec = arg, **prev;
+
+    pthread_mutex_lock(&epoch_lock);
+
+    for (prev = &records; *prev; prev = &(*prev)->next) {
+        if (*prev == rec) {
+            *prev = rec->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&epoch_lock);
+}
+
+static void epoch_key_init(void)
+{
+    pthread_key_create(&epoch_key, epoch_unregister);
+}
+
+static void epoch_register(struct epoch_record *rec)
+{
+    pthread_once(&epoch_once, epoch_key_init);
+    pthread_mutex_lock(&epoch_lock);
+    rec->next = records;
+    records = rec;
+    rec->registered = 1;
+    pthread_mutex_unlock(&epoch_lock);
+    pthread_setspecific(epoch_key, rec);
+}
+
+void epoch_enter(void)
+{
+    struct epoch_record *rec = &thread_record;
+
+    if (!rec->registered)
+        epoch_register(rec);
+
+    if (rec->nesting++ == 0) {
+        store_release(&rec->epoch, load_acquire(&global_epoch));
+        /* The announcement must be visible before we read any
+         * shared data */
+        __sync_synchronize();
+    }
+}
+
+void epoch_exit(void)
+{
+    struct epoch_record *rec = &thread_record;
+
+    store_release(&rec->nesting, rec->nesting - 1);
+}
+
+int epoch_in_section(void)
+{
+    return thread_record.nesting != 0;
+}
+
+/*
+  Advance the global epoch if all threads in a read-side section have
+  observed the current one. Must be called with the epoch lock held.
+  Returns the list of entries that became safe to reclaim.
+*/
+static struct epoch_entry *epoch_try_advance(void)
+{
+    struct epoch_record *rec;
+    struct epoch_entry *list;
+    unsigned long epoch = global_epoch;
+
+    for (rec = records; rec; rec = rec->next) {
+        if (load_acquire(&rec->nesting) &&
+            load_acquire(&rec->epoch) != epoch)
+            return NULL;
+    }
+
+    epoch++;
+    store_release(&global_epoch, epoch);
+    list = limbo[(epoch + 1) % EPOCH_NUM_LISTS];
+    limbo[(epoch + 1) % EPOCH_NUM_LISTS] = NULL;
+
+    return list;
+}
+
+int epoch_poll(void)
+{
+    struct epoch_entry *list;
+    int n = 0;
+
+    pthread_mutex_lock(&epoch_lock);
+    list = epoch_try_advance();
+    pthread_mutex_unlock(&epoch_lock);
+
+    while (list) {
+        struct epoch_entry *e = list;
+        list = e->next;
+        e->fn(e);
+        n++;
+    }
+    return n;
+}
+
+void epoch_defer(struct epoch_entry *e, void (*fn)(struct epoch_entry *))
+{
+    unsigned long n;
+
+    e->fn = fn;
+
+    pthread_mutex_lock(&epoch_lock);
+    e->epoch = global_epoch;
+    e->next = limbo[e->epoch % EPOCH_NUM_LISTS];
+    limbo[e->epoch % EPOCH_NUM_LISTS] = e;
+    n = ++num_deferred;
+    pthread_mutex_unlock(&epoch_lock);
+
+    if (n % EPOCH_POLL_INTERVAL == 0)
+        epoch_poll();
+}
+
+unsigned long epoch_snapshot(void)
+{
+    __sync_synchronize();
+    return load_acquire(&global_epoch);
+}
+
+int epoch_elapsed(unsigned long epoch)
+{
+    if (load_acquire(&global_epoch) - epoch >= 2)
+        return 1;
+
+    epoch_poll();
+
+    return load_acquire(&global_epoch) - epoch >= 2;
+}
+
+void epoch_synchronize(void)
+{
+    unsigned long epoch = epoch_snapshot();
+
+    while (1) {
+        epoch_poll();
+
+        if (load_acquire(&global_epoch) - epoch >= 2)
+            break;
+
+        sched_yield();
+    }
+}
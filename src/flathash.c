@@ -0,0 +1,318 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Open-addressing hash table with group-probed control bytes.
+ *
+ * Each slot has a control byte that is either EMPTY, DELETED or, for
+ * a full slot, the low seven bits of the key's hash (H2). The
+ * remaining hash bits (H1) select the group of slots where probing
+ * starts. Groups are probed in triangular order, which visits every
+ * group since the number of groups is a power of two. A probe stops
+ * at the first group that has an EMPTY slot, so erasing only leaves
+ * a DELETED tombstone when the slot's group is full.
+ *
+ * Author: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <ckit/flathash.h>
+#include <ckit/hash.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define CTRL_EMPTY ((signed char)-128)
+#define CTRL_DELETED ((signed char)-2)
+
+/* Grow when more than 7/8 of the slots are in use */
+#define FLATHASH_MAX_LOAD(slots) ((slots) - (slots) / 8)
+
+static inline unsigned int flathash_hashkey(struct flathash *fh,
+                                            const void *key)
+{
+    /* Both H1 and H2 are taken from the hash, so hashes with
+     * low-entropy bits are mixed further */
+    return hash_mix32(fh->hashfn(key, fh->seed));
+}
+
+static inline unsigned int hash_h1(unsigned int hash)
+{
+    return hash >> 7;
+}
+
+static inline signed char hash_h2(unsigned int hash)
+{
+    return hash & 0x7f;
+}
+
+#if defined(__SSE2__)
+static inline unsigned int group_match(const signed char *ctrl,
+                                       signed char h2)
+{
+    __m128i g = _mm_load_si128((const __m128i *)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(h2)));
+}
+
+static inline unsigned int group_match_free(const signed char *ctrl)
+{
+    /* EMPTY and DELETED are the only negative control bytes */
+    return _mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl));
+}
+#else
+static inline unsigned int group_match(const signed char *ctrl,
+                                       signed char h2)
+{
+    unsigned int i, mask = 0;
+
+    for (i = 0; i < FLATHASH_GROUP_SIZE; i++)
+        mask |= (ctrl[i] == h2) << i;
+
+    return mask;
+}
+
+static inline unsigned int group_match_free(const signed char *ctrl)
+{
+    unsigned int i, mask = 0;
+
+    for (i = 0; i < FLATHASH_GROUP_SIZE; i++)
+        mask |= (ctrl[i] < 0) << i;
+
+    return mask;
+}
+#endif /* __SSE2__ */
+
+static inline unsigned int group_match_empty(const signed char *ctrl)
+{
+    return group_match(ctrl, CTRL_EMPTY);
+}
+
+static inline unsigned int flathash_capacity(const struct flathash *fh)
+{
+    return (fh->mask + 1) * FLATHASH_GROUP_SIZE;
+}
+
+static int flathash_alloc(struct flathash *fh, unsigned int groups)
+{
+    unsigned int slots = groups * FLATHASH_GROUP_SIZE;
+    void *ctrl;
+
+    /* Groups are loaded with aligned vector loads */
+    if (posix_memalign(&ctrl, 64, slots))
+        return -1;
+
+    fh->slots = malloc(sizeof(struct flathash_slot) * slots);
+
+    if (!fh->slots) {
+        free(ctrl);
+        return -1;
+    }
+
+    memset(ctrl, CTRL_EMPTY, slots);
+    fh->ctrl = ctrl;
+    fh->mask = groups - 1;
+    fh->count = 0;
+    fh->growth_left = FLATHASH_MAX_LOAD(slots);
+
+    return 0;
+}
+
+int flathash_init(struct flathash *fh, unsigned int size,
+                  flathash_hashfn_t hashfn, flathash_equalfn_t equalfn)
+{
+    unsigned int groups = 1;
+
+    memset(fh, 0, sizeof(*fh));
+    fh->hashfn = hashfn;
+    fh->equalfn = equalfn;
+    fh->seed = hash_random_seed();
+
+    while (FLATHASH_MAX_LOAD(groups * FLATHASH_GROUP_SIZE) < size)
+        groups <<= 1;
+
+    return flathash_alloc(fh, groups);
+}
+
+void flathash_fini(struct flathash *fh)
+{
+    free(fh->ctrl);
+    free(fh->slots);
+    fh->ctrl = NULL;
+    fh->slots = NULL;
+    fh->count = 0;
+}
+
+/*
+  Find the slot holding the given key, or -1 if not found.
+*/
+static int flathash_find(struct flathash *fh, const void *key,
+                         unsigned int hash)
+{
+    unsigned int g = hash_h1(hash) & fh->mask, step = 0;
+    signed char h2 = hash_h2(hash);
+
+    while (1) {
+        const signed char *ctrl = fh->ctrl + g * FLATHASH_GROUP_SIZE;
+        unsigned int match = group_match(ctrl, h2);
+
+        while (match) {
+            unsigned int i = g * FLATHASH_GROUP_SIZE +
+                __builtin_ctz(match);
+
+            if (fh->equalfn(fh->slots[i].key, key))
+                return i;
+
+            match &= match - 1;
+        }
+
+        if (group_match_empty(ctrl) || step == fh->mask)
+            return -1;
+
+        g = (g + ++step) & fh->mask;
+    }
+}
+
+/*
+  Find the first EMPTY or DELETED slot in the key's probe sequence.
+*/
+static unsigned int flathash_find_free(struct flathash *fh,
+                                       unsigned int hash)
+{
+    unsigned int g = hash_h1(hash) & fh->mask, step = 0;
+
+    while (1) {
+        unsigned int match;
+
+        match = group_match_free(fh->ctrl + g * FLATHASH_GROUP_SIZE);
+
+        if (match)
+            return g * FLATHASH_GROUP_SIZE + __builtin_ctz(match);
+
+        g = (g + ++step) & fh->mask;
+    }
+}
+
+static void flathash_set(struct flathash *fh, unsigned int i,
+                         unsigned int hash, const void *key, void *value)
+{
+    if (fh->ctrl[i] == CTRL_EMPTY)
+        fh->growth_left--;
+
+    fh->ctrl[i] = hash_h2(hash);
+    fh->slots[i].key = key;
+    fh->slots[i].value = value;
+    fh->count++;
+}
+
+/*
+  Move all elements to new arrays, dropping tombstones. The table
+  doubles in size unless it is mostly filled with tombstones.
+*/
+static int flathash_rehash(struct flathash *fh)
+{
+    struct flathash old = *fh;
+    unsigned int i, groups = fh->mask + 1;
+
+    if (fh->count >= FLATHASH_MAX_LOAD(flathash_capacity(fh)) / 2)
+        groups <<= 1;
+
+    if (flathash_alloc(fh, groups)) {
+        *fh = old;
+        return -1;
+    }
+
+    for (i = 0; i < flathash_capacity(&old); i++) {
+        unsigned int hash;
+
+        if (old.ctrl[i] < 0)
+            continue;
+
+        hash = flathash_hashkey(fh, old.slots[i].key);
+        flathash_set(fh, flathash_find_free(fh, hash), hash,
+                     old.slots[i].key, old.slots[i].value);
+    }
+
+    free(old.ctrl);
+    free(old.slots);
+
+    return 0;
+}
+
+int flathash_insert(struct flathash *fh, const void *key, void *value)
+{
+    unsigned int i, hash = flathash_hashkey(fh, key);
+
+    if (flathash_find(fh, key, hash) != -1)
+        return -1;
+
+    i = flathash_find_free(fh, hash);
+
+    /* Reusing a tombstone does not use up an empty slot */
+    if (fh->growth_left == 0 && fh->ctrl[i] == CTRL_EMPTY) {
+        if (flathash_rehash(fh))
+            return -1;
+
+        i = flathash_find_free(fh, hash);
+    }
+
+    flathash_set(fh, i, hash, key, value);
+
+    return 0;
+}
+
+void *flathash_lookup(struct flathash *fh, const void *key)
+{
+    int i = flathash_find(fh, key, flathash_hashkey(fh, key));
+
+    if (i == -1)
+        return NULL;
+
+    return fh->slots[i].value;
+}
+
+void *flathash_erase(struct flathash *fh, const void *key)
+{
+    const signed char *group;
+    int i = flathash_find(fh, key, flathash_hashkey(fh, key));
+
+    if (i == -1)
+        return NULL;
+
+    group = fh->ctrl + (i & ~(FLATHASH_GROUP_SIZE - 1));
+
+    /* No probe continued past a group with an empty slot, so this
+     * slot can be made empty rather than a tombstone */
+    if (group_match_empty(group)) {
+        fh->ctrl[i] = CTRL_EMPTY;
+        fh->growth_left++;
+    } else {
+        fh->ctrl[i] = CTRL_DELETED;
+    }
+    fh->count--;
+
+    return fh->slots[i].value;
+}
+
+int flathash_foreach(struct flathash *fh,
+                     void (*action)(const void *key, void *value, void *data),
+                     void *data)
+{
+    unsigned int g;
+    int n = 0;
+
+    if (!action)
+        return -1;
+
+    for (g = 0; g <= fh->mask; g++) {
+        const signed char *ctrl = fh->ctrl + g * FLATHASH_GROUP_SIZE;
+        unsigned int full = ~group_match_free(ctrl) &
+            ((1U << FLATHASH_GROUP_SIZE) - 1);
+
+        while (full) {
+            unsigned int i = g * FLATHASH_GROUP_SIZE + __builtin_ctz(full);
+            action(fh->slots[i].key, fh->slots[i].value, data);
+            full &= full - 1;
+            n++;
+        }
+    }
+    return n;
+}
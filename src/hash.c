@@ -0,0 +1,128 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Out-of-line parts of the hash functions in ckit/hash.h.
+ *
+ * Long keys are consumed in 64-byte stripes that are accumulated into
+ * eight independent 64-bit lanes, each adding the product of the two
+ * halves of a keyed input word. The lanes are scrambled every block
+ * of stripes and folded into the seed at the end. The SSE2 and
+ * scalar versions compute the same result.
+ *
+ * Author: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ckit/hash.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define HASH_STRIPE_LEN 64
+#define HASH_STRIPES_PER_BLOCK 16
+#define HASH_LANES 8
+
+#if defined(__SSE2__)
+static void hash_accumulate(uint64_t *acc, const unsigned char *p,
+                            const uint64_t *key, size_t stripes)
+{
+    __m128i *xacc = (__m128i *)acc;
+    const __m128i *xkey = (const __m128i *)key;
+    size_t s;
+    int j;
+
+    for (s = 0; s < stripes; s++, p += HASH_STRIPE_LEN) {
+        for (j = 0; j < HASH_LANES / 2; j++) {
+            __m128i d = _mm_loadu_si128((const __m128i *)(p + 16 * j));
+            __m128i dk = _mm_xor_si128(d, _mm_load_si128(xkey + j));
+            __m128i prod = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+            xacc[j] = _mm_add_epi64(xacc[j], _mm_add_epi64(prod, swapped));
+        }
+    }
+}
+#else
+static void hash_accumulate(uint64_t *acc, const unsigned char *p,
+                            const uint64_t *key, size_t stripes)
+{
+    size_t s;
+    int i;
+
+    for (s = 0; s < stripes; s++, p += HASH_STRIPE_LEN) {
+        for (i = 0; i < HASH_LANES; i++) {
+            uint64_t d = hash_read64(p + 8 * i);
+            uint64_t dk = d ^ key[i];
+            acc[i ^ 1] += d;
+            acc[i] += (dk & 0xffffffffULL) * (dk >> 32);
+        }
+    }
+}
+#endif /* __SSE2__ */
+
+static void hash_scramble(uint64_t *acc, const uint64_t *key)
+{
+    int i;
+
+    for (i = 0; i < HASH_LANES; i++) {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= key[i];
+        acc[i] *= 0x9e3779b1ULL;
+    }
+}
+
+uint64_t hash_bytes_long(const unsigned char *p, size_t len,
+                         uint64_t seed, size_t *consumed)
+{
+    uint64_t acc[HASH_LANES] __attribute__((aligned(16)));
+    uint64_t key[HASH_LANES] __attribute__((aligned(16)));
+    size_t stripes = len / HASH_STRIPE_LEN;
+    int i;
+
+    for (i = 0; i < HASH_LANES; i++) {
+        key[i] = hash_mix64(seed + (i + 1) * HASH_P0);
+        acc[i] = key[i] ^ HASH_P2;
+    }
+
+    *consumed = stripes * HASH_STRIPE_LEN;
+
+    while (stripes > 0) {
+        size_t n = stripes < HASH_STRIPES_PER_BLOCK ?
+            stripes : HASH_STRIPES_PER_BLOCK;
+
+        hash_accumulate(acc, p, key, n);
+        hash_scramble(acc, key);
+        p += n * HASH_STRIPE_LEN;
+        stripes -= n;
+    }
+
+    for (i = 0; i < HASH_LANES; i += 2)
+        seed = hash_mum(acc[i] ^ HASH_P1, acc[i + 1] ^ seed);
+
+    return seed;
+}
+
+uint64_t hash_random_seed(void)
+{
+    static unsigned long counter;
+    struct timespec ts;
+    uint64_t seed = 0;
+    int fd;
+
+    fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd != -1) {
+        if (read(fd, &seed, sizeof(seed)) != sizeof(seed))
+            seed = 0;
+        close(fd);
+    }
+
+    /* Still make seeds differ between tables and runs if there is no
+     * randomness to be had */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    seed ^= hash_mix64((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+    seed ^= hash_mix64((uintptr_t)&seed +
+                       __sync_add_and_fetch(&counter, 1) * HASH_P0);
+
+    return seed;
+}
@@ -0,0 +1,409 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Frozen hash tables using a hash-and-displace minimal perfect hash
+ * function (CHD).
+ *
+ * The distinct element hashes are split into buckets of about four,
+ * and each hash gets two values f1 and f2 in [0, n). A bucket with
+ * displacement (d0, d1) places its hashes at (f1 + d0 * f2 + d1) mod
+ * n. Buckets are placed largest first, trying displacements until
+ * all of the bucket's positions are free. Single-hash buckets, placed
+ * last, are sent straight to a free position through d1.
+ *
+ * The perfect hash function works on the 32-bit hashes of the source
+ * table. Different keys with the same hash share a position, and are
+ * then found through a small start index into the entry array.
+ *
+ * Author: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <ckit/hashfrozen.h>
+#include <ckit/debug.h>
+
+/* Average number of distinct hashes per bucket. */
+#define HASHFROZEN_BUCKET_LOAD 4
+
+/* Number of seeds to try before giving up on a build. */
+#define HASHFROZEN_ATTEMPTS 8
+
+/* Displacements tried per bucket before trying another seed. */
+#define HASHFROZEN_MAX_TRIES (1 << 22)
+
+struct freeze_ctx {
+    struct hashelm **elms;
+    unsigned int count;
+    unsigned int size;
+    int err;
+};
+
+struct frozen_key {
+    unsigned int bucket;
+    unsigned int f1;
+    unsigned int f2;
+};
+
+static inline void frozen_key(const struct hashfrozen *hf, unsigned int hash,
+                              struct frozen_key *k)
+{
+    uint64_t h = hash_mix64(hash ^ hf->pseed);
+    uint32_t lo = (uint32_t)h, hi = (uint32_t)(h >> 32);
+
+    k->bucket = hi % hf->nbuckets;
+    k->f1 = lo % hf->npos;
+    k->f2 = hf->npos > 1 ? 1 + hash_mix32(lo ^ hi) % (hf->npos - 1) : 0;
+}
+
+static inline unsigned int frozen_pos(const struct hashfrozen *hf,
+                                      const struct frozen_key *k,
+                                      const struct hashfrozen_disp *d)
+{
+    return (k->f1 + (uint64_t)d->d0 * k->f2 % hf->npos + d->d1) % hf->npos;
+}
+
+static void freeze_elm(struct hashelm *he, void *data)
+{
+    struct freeze_ctx *ctx = data;
+
+    if (ctx->count == ctx->size) {
+        unsigned int size = ctx->size ? ctx->size * 2 : 256;
+        struct hashelm **elms = realloc(ctx->elms, sizeof(*elms) * size);
+
+        if (!elms) {
+            ctx->err = 1;
+            return;
+        }
+        ctx->elms = elms;
+        ctx->size = size;
+    }
+    hashelm_hold(he);
+    ctx->elms[ctx->count++] = he;
+}
+
+static int hashelm_cmp(const void *a, const void *b)
+{
+    unsigned int h1 = (*(struct hashelm *const *)a)->hash;
+    unsigned int h2 = (*(struct hashelm *const *)b)->hash;
+
+    return h1 < h2 ? -1 : h1 > h2;
+}
+
+/*
+  Try to place the bucket's hashes with the given displacement.
+*/
+static int bucket_fits(const struct hashfrozen *hf,
+                       const struct frozen_key *keys,
+                       const unsigned int *members, unsigned int n,
+                       const struct hashfrozen_disp *d,
+                       const unsigned char *taken, unsigned int *pos)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < n; i++) {
+        pos[i] = frozen_pos(hf, &keys[members[i]], d);
+
+        if (taken[pos[i]])
+            return 0;
+
+        for (j = 0; j < i; j++)
+            if (pos[j] == pos[i])
+                return -1;
+    }
+    return 1;
+}
+
+/*
+  Find a displacement for every bucket with the current seed, setting
+  the position of each distinct hash. Returns -1 if some bucket could
+  not be placed.
+*/
+static int frozen_place(struct hashfrozen *hf, const unsigned int *hashes,
+                        unsigned int *positions)
+{
+    struct frozen_key *keys;
+    unsigned int *bstart, *members, *order, *pos;
+    unsigned char *taken;
+    unsigned int i, j, b, max = 0, next_free = 0;
+    int ret = -1;
+
+    keys = malloc(sizeof(*keys) * hf->npos);
+    bstart = calloc(hf->nbuckets + 2, sizeof(*bstart));
+    members = malloc(sizeof(*members) * hf->npos);
+    order = malloc(sizeof(*order) * hf->nbuckets);
+    taken = calloc(hf->npos, 1);
+    pos = NULL;
+
+    if (!keys || !bstart || !members || !order || !taken)
+        goto out;
+
+    /* Group the hashes by bucket */
+    for (i = 0; i < hf->npos; i++) {
+        frozen_key(hf, hashes[i], &keys[i]);
+        bstart[keys[i].bucket + 2]++;
+    }
+
+    for (b = 0; b < hf->nbuckets; b++) {
+        if (bstart[b + 2] > max)
+            max = bstart[b + 2];
+        bstart[b + 2] += bstart[b + 1];
+    }
+
+    for (i = 0; i < hf->npos; i++)
+        members[bstart[keys[i].bucket + 1]++] = i;
+
+    /* Order the buckets by decreasing size */
+    {
+        unsigned int *sizes = calloc(max + 2, sizeof(*sizes));
+
+        if (!sizes)
+            goto out;
+
+        for (b = 0; b < hf->nbuckets; b++)
+            sizes[max - (bstart[b + 1] - bstart[b])]++;
+
+        for (i = 0, b = 0; i <= max; i++) {
+            unsigned int n = sizes[i];
+            sizes[i] = b;
+            b += n;
+        }
+
+        for (b = 0; b < hf->nbuckets; b++)
+            order[sizes[max - (bstart[b + 1] - bstart[b])]++] = b;
+
+        free(sizes);
+    }
+
+    pos = malloc(sizeof(*pos) * (max ? max : 1));
+
+    if (!pos)
+        goto out;
+
+    for (i = 0; i < hf->nbuckets; i++) {
+        struct hashfrozen_disp *d;
+        unsigned int n, *m, tries = 0;
+
+        b = order[i];
+        n = bstart[b + 1] - bstart[b];
+        m = &members[bstart[b]];
+        d = &hf->disp[b];
+        d->d0 = d->d1 = 0;
+
+        if (n == 0)
+            continue;
+
+        if (n == 1) {
+            /* Shift straight to the next free position */
+            while (taken[next_free])
+                next_free++;
+
+            d->d1 = (next_free + hf->npos - keys[m[0]].f1) % hf->npos;
+            pos[0] = next_free;
+        } else {
+            int fit;
+
+            while ((fit = bucket_fits(hf, keys, m, n, d, taken, pos)) != 1) {
+                if (++tries == HASHFROZEN_MAX_TRIES)
+                    goto out;
+
+                /* Shifting cannot separate hashes that collide with
+                 * each other, so try another d0 right away */
+                if (fit == -1 || ++d->d1 == hf->npos) {
+                    d->d1 = 0;
+
+                    if (++d->d0 == hf->npos)
+                        goto out;
+                }
+            }
+        }
+
+        for (j = 0; j < n; j++) {
+            taken[pos[j]] = 1;
+            positions[m[j]] = pos[j];
+        }
+    }
+
+    ret = 0;
+out:
+    free(keys);
+    free(bstart);
+    free(members);
+    free(order);
+    free(taken);
+    free(pos);
+
+    return ret;
+}
+
+/*
+  Build the perfect hash function and entry array from elements
+  sorted by hash.
+*/
+static int frozen_build(struct hashfrozen *hf, struct hashelm **elms)
+{
+    unsigned int *hashes, *positions, *groups;
+    unsigned int i, j, attempt;
+    int ret = -1;
+
+    if (hf->count == 0)
+        return 0;
+
+    hashes = malloc(sizeof(*hashes) * hf->count);
+    groups = malloc(sizeof(*groups) * (hf->count + 1));
+
+    for (i = 0, hf->npos = 0; hashes && groups && i < hf->count; i++) {
+        if (i == 0 || elms[i]->hash != elms[i - 1]->hash) {
+            groups[hf->npos] = i;
+            hashes[hf->npos++] = elms[i]->hash;
+        }
+    }
+
+    positions = malloc(sizeof(*positions) * hf->count);
+    hf->nbuckets = hf->npos / HASHFROZEN_BUCKET_LOAD + 1;
+    hf->disp = malloc(sizeof(*hf->disp) * hf->nbuckets);
+    hf->entries = malloc(sizeof(*hf->entries) * hf->count);
+
+    if (!hashes || !groups || !positions || !hf->disp || !hf->entries)
+        goto out;
+
+    groups[hf->npos] = hf->count;
+
+    for (attempt = 0; attempt < HASHFROZEN_ATTEMPTS; attempt++) {
+        hf->pseed = hash_random_seed();
+
+        if (frozen_place(hf, hashes, positions) == 0)
+            break;
+    }
+
+    if (attempt == HASHFROZEN_ATTEMPTS) {
+        LOG_ERR("Could not build perfect hash function\n");
+        goto out;
+    }
+
+    /* With unique hashes, positions index the entries directly */
+    if (hf->npos != hf->count) {
+        hf->start = calloc(hf->npos + 1, sizeof(*hf->start));
+
+        if (!hf->start)
+            goto out;
+
+        for (i = 0; i < hf->npos; i++)
+            hf->start[positions[i] + 1] = groups[i + 1] - groups[i];
+
+        for (i = 0; i < hf->npos; i++)
+            hf->start[i + 1] += hf->start[i];
+    }
+
+    for (i = 0; i < hf->npos; i++) {
+        unsigned int p = hf->start ? hf->start[positions[i]] : positions[i];
+
+        for (j = groups[i]; j < groups[i + 1]; j++, p++) {
+            hf->entries[p].hash = elms[j]->hash;
+            hf->entries[p].he = elms[j];
+        }
+    }
+
+    ret = 0;
+out:
+    free(hashes);
+    free(groups);
+    free(positions);
+
+    return ret;
+}
+
+struct hashfrozen *hashtable_freeze(struct hashtable *ht)
+{
+    struct freeze_ctx ctx;
+    struct hashfrozen *hf;
+    unsigned int i;
+
+    hf = calloc(1, sizeof(*hf));
+
+    if (!hf)
+        return NULL;
+
+    memset(&ctx, 0, sizeof(ctx));
+    hashtable_foreach_read(ht, freeze_elm, &ctx);
+
+    hf->count = ctx.count;
+    hf->seed = ht->seed;
+    hf->hashfn = ht->hashfn;
+    hf->equalfn = ht->equalfn;
+
+    if (!ctx.err) {
+        qsort(ctx.elms, ctx.count, sizeof(*ctx.elms), hashelm_cmp);
+
+        if (frozen_build(hf, ctx.elms) == 0) {
+            free(ctx.elms);
+            return hf;
+        }
+    }
+
+    for (i = 0; i < ctx.count; i++)
+        hashelm_put(ctx.elms[i]);
+
+    free(ctx.elms);
+    free(hf->disp);
+    free(hf->start);
+    free(hf->entries);
+    free(hf);
+
+    return NULL;
+}
+
+struct hashelm *hashfrozen_lookup(const struct hashfrozen *hf,
+                                  const void *key)
+{
+    unsigned int hash, p, end;
+    struct frozen_key k;
+
+    if (hf->count == 0)
+        return NULL;
+
+    hash = hf->hashfn(key, hf->seed);
+    frozen_key(hf, hash, &k);
+    p = frozen_pos(hf, &k, &hf->disp[k.bucket]);
+
+    if (!hf->start) {
+        const struct hashfrozen_entry *e = &hf->entries[p];
+
+        if (e->hash == hash && hf->equalfn(e->he, key))
+            return e->he;
+
+        return NULL;
+    }
+
+    for (end = hf->start[p + 1], p = hf->start[p]; p < end; p++) {
+        const struct hashfrozen_entry *e = &hf->entries[p];
+
+        if (e->hash == hash && hf->equalfn(e->he, key))
+            return e->he;
+    }
+    return NULL;
+}
+
+void hashfrozen_free(struct hashfrozen *hf)
+{
+    unsigned int i;
+
+    for (i = 0; i < hf->count; i++)
+        hashelm_put(hf->entries[i].he);
+
+    free(hf->disp);
+    free(hf->start);
+    free(hf->entries);
+    free(hf);
+}
+
+static void hashfrozen_free_rcu(struct epoch_entry *e)
+{
+    hashfrozen_free(epoch_entry(e, struct hashfrozen, rcu));
+}
+
+void hashfrozen_publish(struct hashfrozen **ptr, struct hashfrozen *hf)
+{
+    struct hashfrozen *old = __atomic_exchange_n(ptr, hf, __ATOMIC_ACQ_REL);
+
+    if (old)
+        epoch_defer(&old->rcu, hashfrozen_free_rcu);
+}
@@ -0,0 +1,394 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Memory-mappable hash table snapshots.
+ *
+ * The table is first traversed only to take a reference to each
+ * element, so that slot locks are held briefly and resizes are not
+ * held off by disk writes. Records are then encoded and streamed to
+ * the file without any table locks. Only a pointer per element and a
+ * 16-byte index entry per record are kept in memory. The index is
+ * then sorted by bucket and written after the records, followed by
+ * the bucket table. A lookup thus touches the bucket table, the
+ * bucket's index entries and the matching record.
+ *
+ * Author: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ckit/hashsnap.h>
+#include <ckit/debug.h>
+
+#define HASHSNAP_BYTE_ORDER 0x01020304
+#define HASHSNAP_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+struct snapshot_ctx {
+    FILE *f;
+    struct hashelm **elms; /* Held until written */
+    uint64_t nelms;
+    uint64_t elms_size;
+    hashsnap_encodefn_t encode;
+    void *data;
+    uint64_t seed;
+    struct hashsnap_index *index;
+    uint64_t count;
+    uint64_t size;
+    uint64_t off; /* Of the next record */
+    int err;
+};
+
+static const unsigned char zeros[8];
+
+static void snapshot_hold(struct hashelm *he, void *data)
+{
+    struct snapshot_ctx *ctx = data;
+
+    if (ctx->err)
+        return;
+
+    if (ctx->nelms == ctx->elms_size) {
+        uint64_t size = ctx->elms_size ? ctx->elms_size * 2 : 1024;
+        struct hashelm **elms;
+
+        elms = realloc(ctx->elms, sizeof(*elms) * size);
+
+        if (!elms) {
+            ctx->err = 1;
+            return;
+        }
+        ctx->elms = elms;
+        ctx->elms_size = size;
+    }
+
+    hashelm_hold(he);
+    ctx->elms[ctx->nelms++] = he;
+}
+
+static void snapshot_elm(struct snapshot_ctx *ctx, struct hashelm *he)
+{
+    struct hashsnap_record rec;
+    struct hashsnap_rec hdr;
+    size_t len;
+
+    if (ctx->err || ctx->encode(he, &rec, ctx->data) == -1)
+        return;
+
+    if (rec.key_len > UINT32_MAX || rec.value_len > UINT32_MAX) {
+        LOG_ERR("Snapshot record too large\n");
+        ctx->err = 1;
+        return;
+    }
+
+    if (ctx->count == ctx->size) {
+        uint64_t size = ctx->size ? ctx->size * 2 : 1024;
+        struct hashsnap_index *index;
+
+        index = realloc(ctx->index, sizeof(*index) * size);
+
+        if (!index) {
+            ctx->err = 1;
+            return;
+        }
+        ctx->index = index;
+        ctx->size = size;
+    }
+
+    hdr.key_len = rec.key_len;
+    hdr.value_len = rec.value_len;
+    len = sizeof(hdr) + rec.key_len + rec.value_len;
+
+    if (fwrite(&hdr, sizeof(hdr), 1, ctx->f) != 1 ||
+        fwrite(rec.key, 1, rec.key_len, ctx->f) != rec.key_len ||
+        fwrite(rec.value, 1, rec.value_len, ctx->f) != rec.value_len ||
+        fwrite(zeros, 1, HASHSNAP_ALIGN(len) - len, ctx->f) !=
+        HASHSNAP_ALIGN(len) - len) {
+        ctx->err = 1;
+        return;
+    }
+
+    ctx->index[ctx->count].hash = hash_bytes_seed(rec.key, rec.key_len,
+                                                  ctx->seed);
+    ctx->index[ctx->count].offset = ctx->off;
+    ctx->count++;
+    ctx->off += HASHSNAP_ALIGN(len);
+}
+
+/*
+  Write the index, ordered by bucket with a counting sort, and the
+  bucket table.
+*/
+static int snapshot_write_index(struct snapshot_ctx *ctx,
+                                struct hashsnap_header *hdr)
+{
+    struct hashsnap_index *sorted;
+    uint64_t *buckets, i, mask;
+    int ret = -1;
+
+    hdr->nbuckets = 1;
+
+    while (hdr->nbuckets < ctx->count)
+        hdr->nbuckets <<= 1;
+
+    mask = hdr->nbuckets - 1;
+    buckets = calloc(hdr->nbuckets + 1, sizeof(*buckets));
+    sorted = malloc(sizeof(*sorted) * (ctx->count ? ctx->count : 1));
+
+    if (!buckets || !sorted)
+        goto out;
+
+    for (i = 0; i < ctx->count; i++)
+        buckets[(ctx->index[i].hash & mask) + 1]++;
+
+    for (i = 0; i < hdr->nbuckets; i++)
+        buckets[i + 1] += buckets[i];
+
+    /* Place entries using the bucket starts as cursors, which leaves
+     * each cursor at the next bucket's start */
+    for (i = 0; i < ctx->count; i++)
+        sorted[buckets[ctx->index[i].hash & mask]++] = ctx->index[i];
+
+    memmove(buckets + 1, buckets, sizeof(*buckets) * hdr->nbuckets);
+    buckets[0] = 0;
+
+    hdr->index_off = ctx->off;
+    hdr->buckets_off = hdr->index_off + sizeof(*sorted) * ctx->count;
+    hdr->size = hdr->buckets_off + sizeof(*buckets) * (hdr->nbuckets + 1);
+
+    if (fwrite(sorted, sizeof(*sorted), ctx->count, ctx->f) != ctx->count ||
+        fwrite(buckets, sizeof(*buckets), hdr->nbuckets + 1, ctx->f) !=
+        hdr->nbuckets + 1)
+        goto out;
+
+    ret = 0;
+out:
+    free(buckets);
+    free(sorted);
+
+    return ret;
+}
+
+int hashtable_snapshot(struct hashtable *ht, const char *path,
+                       hashsnap_encodefn_t encode, void *data)
+{
+    struct snapshot_ctx ctx;
+    struct hashsnap_header hdr;
+    size_t len = strlen(path);
+    uint64_t i;
+    char *tmp;
+    int fd, ret = -1;
+
+    tmp = malloc(len + 8);
+
+    if (!tmp)
+        return -1;
+
+    /* A unique name in the target directory, so that concurrent
+     * snapshots to the same path do not write to the same file */
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".XXXXXX", 8);
+
+    fd = mkstemp(tmp);
+
+    if (fd == -1) {
+        LOG_ERR("Could not create %s: %s\n", tmp, strerror(errno));
+        free(tmp);
+        return -1;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.f = fdopen(fd, "w");
+
+    if (!ctx.f) {
+        LOG_ERR("Could not open %s: %s\n", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    ctx.encode = encode;
+    ctx.data = data;
+    ctx.seed = hash_random_seed();
+    ctx.off = sizeof(hdr);
+
+    memset(&hdr, 0, sizeof(hdr));
+
+    /* The header is rewritten once the rest is in place */
+    if (fwrite(&hdr, sizeof(hdr), 1, ctx.f) != 1)
+        goto out;
+
+    hashtable_foreach_read(ht, snapshot_hold, &ctx);
+
+    for (i = 0; i < ctx.nelms; i++) {
+        snapshot_elm(&ctx, ctx.elms[i]);
+        hashelm_put(ctx.elms[i]);
+    }
+
+    if (ctx.err || snapshot_write_index(&ctx, &hdr))
+        goto out;
+
+    memcpy(hdr.magic, HASHSNAP_MAGIC, sizeof(HASHSNAP_MAGIC));
+    hdr.version = HASHSNAP_VERSION;
+    hdr.byte_order = HASHSNAP_BYTE_ORDER;
+    hdr.seed = ctx.seed;
+    hdr.count = ctx.count;
+
+    if (fseek(ctx.f, 0, SEEK_SET) ||
+        fwrite(&hdr, sizeof(hdr), 1, ctx.f) != 1 ||
+        fflush(ctx.f) || fsync(fileno(ctx.f)))
+        goto out;
+
+    ret = 0;
+out:
+    if (fclose(ctx.f))
+        ret = -1;
+
+    if (ret == 0 && rename(tmp, path)) {
+        LOG_ERR("Could not rename %s: %s\n", tmp, strerror(errno));
+        ret = -1;
+    }
+
+    if (ret == -1)
+        unlink(tmp);
+
+    free(ctx.elms);
+    free(ctx.index);
+    free(tmp);
+
+    return ret;
+}
+
+static int hashsnap_valid(const struct hashsnap_header *hdr, size_t size)
+{
+    const uint64_t *buckets;
+    uint64_t i;
+
+    if (size < sizeof(*hdr) ||
+        memcmp(hdr->magic, HASHSNAP_MAGIC, sizeof(HASHSNAP_MAGIC)) ||
+        hdr->version != HASHSNAP_VERSION ||
+        hdr->byte_order != HASHSNAP_BYTE_ORDER)
+        return 0;
+
+    if (hdr->size != size || hdr->nbuckets == 0 ||
+        (hdr->nbuckets & (hdr->nbuckets - 1)) ||
+        hdr->index_off < sizeof(*hdr) || hdr->index_off > size ||
+        hdr->count > (size - hdr->index_off) / sizeof(struct hashsnap_index) ||
+        hdr->buckets_off != hdr->index_off +
+        hdr->count * sizeof(struct hashsnap_index))
+        return 0;
+
+    /* The bucket table fills the rest of the file. Divide rather than
+     * multiply, which a huge bucket count could overflow. */
+    if ((size - hdr->buckets_off) % sizeof(uint64_t) ||
+        hdr->nbuckets >= (size - hdr->buckets_off) / sizeof(uint64_t) ||
+        hdr->nbuckets + 1 != (size - hdr->buckets_off) / sizeof(uint64_t))
+        return 0;
+
+    /* The bucket table must partition the index, so that lookups stay
+     * within it. Record offsets are checked as lookups reach them. */
+    buckets = (const uint64_t *)((const unsigned char *)hdr +
+                                 hdr->buckets_off);
+
+    if (buckets[0] != 0 || buckets[hdr->nbuckets] != hdr->count)
+        return 0;
+
+    for (i = 0; i < hdr->nbuckets; i++) {
+        if (buckets[i] > buckets[i + 1])
+            return 0;
+    }
+
+    return 1;
+}
+
+int hashsnap_open(struct hashsnap *hs, const char *path)
+{
+    struct stat st;
+    void *base;
+    int fd;
+
+    memset(hs, 0, sizeof(*hs));
+
+    fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        LOG_ERR("Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*hs->hdr)) {
+        close(fd);
+        return -1;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        LOG_ERR("Could not map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (!hashsnap_valid(base, st.st_size)) {
+        LOG_ERR("Invalid snapshot %s\n", path);
+        munmap(base, st.st_size);
+        return -1;
+    }
+
+    /* Lookups touch pages at random, so read-ahead is wasted */
+    madvise(base, st.st_size, MADV_RANDOM);
+
+    hs->base = base;
+    hs->size = st.st_size;
+    hs->hdr = base;
+    hs->index = (const struct hashsnap_index *)(hs->base +
+                                                hs->hdr->index_off);
+    hs->buckets = (const uint64_t *)(hs->base + hs->hdr->buckets_off);
+
+    return 0;
+}
+
+void hashsnap_close(struct hashsnap *hs)
+{
+    if (hs->base)
+        munmap((void *)hs->base, hs->size);
+
+    memset(hs, 0, sizeof(*hs));
+}
+
+int hashsnap_lookup(struct hashsnap *hs, const void *key, size_t key_len,
+                    const void **value, size_t *value_len)
+{
+    uint64_t hash = hash_bytes_seed(key, key_len, hs->hdr->seed);
+    uint64_t b = hash & (hs->hdr->nbuckets - 1), i;
+
+    for (i = hs->buckets[b]; i < hs->buckets[b + 1]; i++) {
+        const struct hashsnap_rec *rec;
+
+        if (hs->index[i].hash != hash)
+            continue;
+
+        /* Records lie between the header and the index, which the
+         * index entries of a corrupt file need not respect */
+        if (hs->index[i].offset < sizeof(*hs->hdr) ||
+            hs->index[i].offset > hs->hdr->index_off - sizeof(*rec))
+            return -1;
+
+        rec = (const struct hashsnap_rec *)(hs->base + hs->index[i].offset);
+
+        if ((uint64_t)rec->key_len + rec->value_len >
+            hs->hdr->index_off - sizeof(*rec) - hs->index[i].offset)
+            return -1;
+
+        if (rec->key_len == key_len && !memcmp(rec->data, key, key_len)) {
+            *value = rec->data + rec->key_len;
+            *value_len = rec->value_len;
+            return 0;
+        }
+    }
+    return -1;
+}
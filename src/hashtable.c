@@ -1,124 +1,813 @@
-/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- 
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
  *
  * A thread-safe hash table implementation with reference-counted
  * elements.
  *
  * Authors: Erik Nordström <erik.nordstrom@gmail.com>
- * 
+ *
  */
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 #include <ckit/hashtable.h>
 #include <ckit/debug.h>
 
+/* Grow when there are more elements than slots, and shrink when
+ * there are less than one element per four slots. */
+#define HTABLE_GROW_LOAD(size) (size)
+#define HTABLE_SHRINK_LOAD(size) ((size) / 4)
+
+/* Number of old buckets to migrate on each table operation during a
+ * resize. */
+#define HTABLE_MIGRATE_STEP 4
+
+/* Number of keys whose slots are prefetched together by
+ * hashtable_lookup_many(). */
+#define HTABLE_LOOKUP_BATCH 16
+
+/* Number of consecutive slots a foreach worker claims at a time. */
+#define HTABLE_FOREACH_CHUNK 64
+
+/*
+  In HTABLE_F_RCU tables, lock-free readers that started before a
+  resize was published may still be walking the old table, so buckets
+  cannot be moved until a grace period has passed.
+*/
+enum migrate_state {
+    MIGRATE_PENDING, /* Resize not yet published */
+    MIGRATE_GRACE, /* Waiting for lock-free readers to leave */
+    MIGRATE_READY,
+};
+
+/*
+  A bucket. With the default locking, each slot is followed by its own
+  pthread rwlock. The other lock modes use the 'lock' word, or a
+  shared stripe, so that a slot is just 24 bytes and several slots
+  share a cache line.
+*/
 struct hashslot {
     list_t head;
-	unsigned long count;
-	pthread_rwlock_t lock;
+    unsigned int lock; /* HTABLE_F_LOCK_SPIN or HTABLE_F_LOCK_SEQ */
+    unsigned int migrated;
 };
 
+struct hashstripe {
+    pthread_rwlock_t lock;
+} __attribute__((aligned(64)));
+
+#define HTABLE_LOCK_MODES \
+    (HTABLE_F_LOCK_SPIN | HTABLE_F_LOCK_SEQ | HTABLE_F_LOCK_STRIPED)
+
+/* Bytes per slot without an rwlock, padded so that two slots share a
+ * cache line and none straddles two */
+#define HTABLE_SLOT_STRIDE 32
+
+/* Writer bit of a spinlock word. The remaining bits count readers. */
+#define SPIN_WRITER 0x80000000U
+
+/*
+  A slot array. The migration state describes the move of this
+  array's buckets to its successor once it has been replaced.
+*/
+struct hashslots {
+    unsigned int size;
+    unsigned int mask;
+    unsigned int stride; /* Bytes per slot, including any rwlock */
+    atomic_t migrate_idx; /* Next bucket to migrate */
+    atomic_t migrated; /* Number of buckets migrated */
+    int migrate_state;
+    unsigned long resize_epoch; /* Epoch when replaced */
+    struct epoch_entry rcu;
+    char slot[0] __attribute__((aligned(64)));
+};
+
+static inline struct hashslot *hashslot_at(struct hashslots *hs,
+                                           unsigned int i)
+{
+    return (struct hashslot *)(hs->slot + (size_t)i * hs->stride);
+}
+
+static inline pthread_rwlock_t *slot_rwlock(struct hashslot *slot)
+{
+    return (pthread_rwlock_t *)(slot + 1);
+}
+
+static inline int hashslots_have_rwlocks(struct hashslots *hs)
+{
+    return hs->stride != HTABLE_SLOT_STRIDE;
+}
+
+static unsigned int roundup_pow2(unsigned int n)
+{
+    unsigned int size = 1;
+
+    while (size < n)
+        size <<= 1;
+
+    return size;
+}
+
+static struct hashslots *hashslots_alloc(struct hashtable *ht,
+                                         unsigned int size)
+{
+    struct hashslots *hs;
+    unsigned int i, stride = HTABLE_SLOT_STRIDE;
+    void *mem;
+
+    if (!(ht->flags & HTABLE_LOCK_MODES))
+        stride = sizeof(struct hashslot) + sizeof(pthread_rwlock_t);
+
+    /* Slots are laid out from a cache line boundary */
+    if (posix_memalign(&mem, 64, sizeof(*hs) + (size_t)stride * size))
+        return NULL;
+
+    hs = mem;
+    hs->size = size;
+    hs->mask = size - 1;
+    hs->stride = stride;
+    atomic_set(&hs->migrate_idx, 0);
+    atomic_set(&hs->migrated, 0);
+    hs->migrate_state = MIGRATE_PENDING;
+
+	for (i = 0; i < size; i++) {
+        struct hashslot *slot = hashslot_at(hs, i);
+
+		INIT_LIST(&slot->head);
+		slot->lock = 0;
+		slot->migrated = 0;
+
+        if (hashslots_have_rwlocks(hs))
+            pthread_rwlock_init(slot_rwlock(slot), NULL);
+	}
+
+    return hs;
+}
+
+static void hashslots_free(struct hashslots *hs)
+{
+    unsigned int i;
+
+    if (hashslots_have_rwlocks(hs)) {
+        for (i = 0; i < hs->size; i++)
+            pthread_rwlock_destroy(slot_rwlock(hashslot_at(hs, i)));
+    }
+
+    free(hs);
+}
+
+static void hashslots_free_rcu(struct epoch_entry *e)
+{
+    hashslots_free(epoch_entry(e, struct hashslots, rcu));
+}
+
+static void spin_lock(unsigned int *lock, int write)
+{
+    while (1) {
+        unsigned int v = __atomic_load_n(lock, __ATOMIC_RELAXED);
+
+        if (write ? v == 0 : !(v & SPIN_WRITER)) {
+            if (__atomic_compare_exchange_n(lock, &v,
+                                            write ? SPIN_WRITER : v + 1,
+                                            0, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED))
+                return;
+        }
+        cpu_relax();
+    }
+}
+
+static void spin_unlock(unsigned int *lock)
+{
+    /* Readers cannot hold the lock while a writer does */
+    if (__atomic_load_n(lock, __ATOMIC_RELAXED) & SPIN_WRITER)
+        store_release(lock, 0);
+    else
+        __atomic_sub_fetch(lock, 1, __ATOMIC_RELEASE);
+}
+
+/*
+  A sequence lock is held for writing while odd. Lock-free readers
+  sample the sequence before and after walking the bucket.
+*/
+static void seq_lock(unsigned int *seq)
+{
+    while (1) {
+        unsigned int v = __atomic_load_n(seq, __ATOMIC_RELAXED);
+
+        if (!(v & 1) &&
+            __atomic_compare_exchange_n(seq, &v, v + 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+
+        cpu_relax();
+    }
+}
+
+static void seq_unlock(unsigned int *seq)
+{
+    store_release(seq, *seq + 1);
+}
+
+/*
+  Lock the given slot, found under the given hash (or bucket index),
+  according to the table's lock mode. Sequence locks have no shared
+  mode, so readers that have to lock take them exclusively.
+*/
+static void slot_lock(struct hashtable *ht, struct hashslot *slot,
+                      unsigned int hash, int write)
+{
+    pthread_rwlock_t *lock;
+
+    if (ht->flags & HTABLE_F_LOCK_SPIN) {
+        spin_lock(&slot->lock, write);
+        return;
+    }
+
+    if (ht->flags & HTABLE_F_LOCK_SEQ) {
+        seq_lock(&slot->lock);
+        return;
+    }
+
+    if (ht->flags & HTABLE_F_LOCK_STRIPED)
+        lock = &ht->stripes[hash & ht->stripe_mask].lock;
+    else
+        lock = slot_rwlock(slot);
+
+    if (write)
+        pthread_rwlock_wrlock(lock);
+    else
+        pthread_rwlock_rdlock(lock);
+}
+
+static void slot_unlock(struct hashtable *ht, struct hashslot *slot,
+                        unsigned int hash)
+{
+    if (ht->flags & HTABLE_F_LOCK_SPIN)
+        spin_unlock(&slot->lock);
+    else if (ht->flags & HTABLE_F_LOCK_SEQ)
+        seq_unlock(&slot->lock);
+    else if (ht->flags & HTABLE_F_LOCK_STRIPED)
+        pthread_rwlock_unlock(&ht->stripes[hash & ht->stripe_mask].lock);
+    else
+        pthread_rwlock_unlock(slot_rwlock(slot));
+}
+
 /*
   Hash table initialization.
 */
-int hashtable_init(struct hashtable *ht, unsigned int size,
-                   hashfn_t hashfn, equalfn_t equalfn, freefn_t freefn)
+int hashtable_init_flags(struct hashtable *ht, unsigned int size,
+                         hashfn_t hashfn, equalfn_t equalfn, freefn_t freefn,
+                         unsigned int flags)
 {
-    int i;
+    unsigned int i;
+
     memset(ht, 0, sizeof(*ht));
-    ht->table = malloc(sizeof(struct hashslot) * size);
-    
-    if (!ht->table)
+
+    if (size < HTABLE_MIN_SIZE)
+        size = HTABLE_MIN_SIZE;
+
+    /* Only one lock mode can be used */
+    if ((flags & HTABLE_LOCK_MODES) & ((flags & HTABLE_LOCK_MODES) - 1)) {
+        LOG_ERR("More than one lock mode\n");
         return -1;
-    
-    ht->mask = size - 1;
-    atomic_set(&ht->count, 1);
+    }
+
+    /* Sequence locks rely on lock-free readers */
+    if (flags & HTABLE_F_LOCK_SEQ)
+        flags |= HTABLE_F_RCU;
+
+    ht->flags = flags;
+    ht->min_size = roundup_pow2(size);
+
+    if (flags & HTABLE_F_LOCK_STRIPED) {
+        unsigned int n = ht->min_size < HTABLE_LOCK_STRIPES ?
+            ht->min_size : HTABLE_LOCK_STRIPES;
+        void *mem;
+
+        /* The table never shrinks below min_size, so slots with the
+         * same hash in the old and new table share a stripe */
+        if (posix_memalign(&mem, 64, sizeof(struct hashstripe) * n))
+            return -1;
+
+        ht->stripes = mem;
+        ht->stripe_mask = n - 1;
+
+        for (i = 0; i < n; i++)
+            pthread_rwlock_init(&ht->stripes[i].lock, NULL);
+    }
+
+    ht->table = hashslots_alloc(ht, ht->min_size);
+
+    if (!ht->table) {
+        free(ht->stripes);
+        ht->stripes = NULL;
+        return -1;
+    }
+
+    atomic_set(&ht->count, 0);
     ht->hashfn = hashfn;
     ht->equalfn = equalfn;
     ht->freefn = freefn;
+    ht->seed = hash_random_seed();
+    pthread_mutex_init(&ht->resize_lock, NULL);
 
     /* LOG_DBG("Initializing hash table\n"); */
 
-	for (i = 0; i <= ht->mask; i++) {
-		INIT_LIST(&ht->table[i].head);
-		ht->table[i].count = 0;
-		pthread_rwlock_init(&ht->table[i].lock, NULL);
-	}
-
     return 0;
 }
 
-void hashtable_fini(struct hashtable *ht)
+int hashtable_init(struct hashtable *ht, unsigned int size,
+                   hashfn_t hashfn, equalfn_t equalfn, freefn_t freefn)
+{
+    return hashtable_init_flags(ht, size, hashfn, equalfn, freefn, 0);
+}
+
+void hashtable_set_seed(struct hashtable *ht, uint64_t seed)
+{
+    ht->seed = seed;
+}
+
+/*
+  Hash a key with the table's hash function and seed.
+*/
+static inline unsigned int hashtable_hashkey(struct hashtable *ht,
+                                             const void *key)
+{
+    return ht->hashfn(key, ht->seed);
+}
+
+static void hashslots_flush(struct hashtable *ht, struct hashslots *hs)
 {
-    int i;
+    unsigned int i;
 
-    for (i = 0; i <= ht->mask; i++) {
+    for (i = 0; i < hs->size; i++) {
+        struct hashslot *slot = hashslot_at(hs, i);
         struct hashelm *he;
-        
-        pthread_rwlock_wrlock(&ht->table[i].lock);
 
-        while (!list_empty(&ht->table[i].head)) {
-            he = list_front(&ht->table[i].head, struct hashelm, list);
+        slot_lock(ht, slot, i, 1);
+
+        while (!list_empty(&slot->head)) {
+            he = list_front(&slot->head, struct hashelm, list);
             list_del(&he->list);
             hashelm_put(he);
         }
 
-		INIT_LIST(&ht->table[i].head);
-		ht->table[i].count = 0;
-        pthread_rwlock_unlock(&ht->table[i].lock);
-		pthread_rwlock_destroy(&ht->table[i].lock);
+        slot_unlock(ht, slot, i);
 	}
+}
+
+void hashtable_fini(struct hashtable *ht)
+{
+    /* Run deferred releases of elements and slot arrays while the
+     * table is still around */
+    epoch_synchronize();
+
+    if (ht->old_table) {
+        hashslots_flush(ht, ht->old_table);
+        hashslots_free(ht->old_table);
+        ht->old_table = NULL;
+    }
+    hashslots_flush(ht, ht->table);
+    hashslots_free(ht->table);
+    ht->table = NULL;
     atomic_set(&ht->count, 0);
-    free(ht->table);
+    pthread_mutex_destroy(&ht->resize_lock);
+
+    if (ht->stripes) {
+        unsigned int i;
+
+        for (i = 0; i <= ht->stripe_mask; i++)
+            pthread_rwlock_destroy(&ht->stripes[i].lock);
+
+        free(ht->stripes);
+        ht->stripes = NULL;
+    }
 }
 
-int hashtable_foreach(struct hashtable *ht, 
-                      void (*action)(struct hashelm *, void *), 
-                      void *data)
+/*
+  Move all elements in the given old bucket to their slots in the new
+  table and mark the bucket as migrated. Must be called within an
+  epoch or with the resize lock held.
+*/
+static void migrate_bucket(struct hashtable *ht, struct hashslots *old,
+                           unsigned int i)
 {
-    int n = 0;
-    unsigned i;
+    struct hashslots *hs = ht->table;
+    struct hashslot *from = hashslot_at(old, i);
+    /* Both buckets are covered by the same stripe */
+    int striped = ht->flags & HTABLE_F_LOCK_STRIPED;
 
-    if (!action)
-        return -1;
+    slot_lock(ht, from, i, 1);
 
-    for (i = 0; i <= ht->mask; i++) {
+    while (!list_empty(&from->head)) {
         struct hashelm *he;
-        
-        pthread_rwlock_wrlock(&ht->table[i].lock);
-        
-        list_foreach(he, &ht->table[i].head, list) {
-            action(he, data);
-            n++;
-        }
+        struct hashslot *slot;
+
+        he = list_front(&from->head, struct hashelm, list);
+        slot = hashslot_at(hs, he->hash & hs->mask);
+        list_del(&he->list);
+
+        if (!striped)
+            slot_lock(ht, slot, he->hash, 1);
+
+        list_add_front(&slot->head, &he->list);
+
+        if (!striped)
+            slot_unlock(ht, slot, he->hash);
+    }
+    store_release(&from->migrated, 1);
+    slot_unlock(ht, from, i);
+    atomic_inc(&old->migrated);
+}
+
+/*
+  Migrate up to 'n' buckets of an ongoing resize. Must be called
+  within an epoch or with the resize lock held.
+*/
+static void hashtable_migrate(struct hashtable *ht, unsigned int n)
+{
+    struct hashslots *old = load_acquire(&ht->old_table);
+    int state;
+
+    if (!old)
+        return;
+
+    state = load_acquire(&old->migrate_state);
+
+    if (state == MIGRATE_PENDING)
+        return;
+
+    if (state == MIGRATE_GRACE) {
+        if (!epoch_elapsed(old->resize_epoch))
+            return;
+        store_release(&old->migrate_state, MIGRATE_READY);
+    }
+
+    while (n-- > 0 &&
+           (unsigned int)atomic_read(&old->migrate_idx) < old->size) {
+        unsigned int i = atomic_inc(&old->migrate_idx) - 1;
+
+        if (i >= old->size)
+            break;
+
+        migrate_bucket(ht, old, i);
+    }
+}
+
+/*
+  Compute the size the table should have given its current load.
+*/
+static unsigned int hashtable_target_size(struct hashtable *ht)
+{
+    unsigned int count = atomic_read(&ht->count);
+    unsigned int size = ht->table->size;
+
+    if (count > HTABLE_GROW_LOAD(size) && (size << 1) > size)
+        return size << 1;
+
+    if (count < HTABLE_SHRINK_LOAD(size) && size > ht->min_size)
+        return size >> 1;
+
+    return size;
+}
+
+/*
+  Publish a new slot array of the given size. Must be called with the
+  resize lock held.
+*/
+static void hashtable_start_resize(struct hashtable *ht, unsigned int size)
+{
+    struct hashslots *old = ht->table, *hs = hashslots_alloc(ht, size);
+
+    if (!hs)
+        return;
+
+    /* Readers check the old table after loading the new one, so it
+     * must be published first */
+    store_release(&ht->old_table, old);
+    store_release(&ht->table, hs);
+
+    if (ht->flags & HTABLE_F_RCU) {
+        old->resize_epoch = epoch_snapshot();
+        store_release(&old->migrate_state, MIGRATE_GRACE);
+    } else {
+        store_release(&old->migrate_state, MIGRATE_READY);
+    }
+}
+
+/*
+  Retire the old slot array once all its buckets are migrated. Must
+  be called with the resize lock held.
+*/
+static void hashtable_finish_resize(struct hashtable *ht)
+{
+    struct hashslots *old = ht->old_table;
+
+    if ((unsigned int)atomic_read(&old->migrated) != old->size)
+        return;
+
+    store_release(&ht->old_table, NULL);
+    epoch_defer(&old->rcu, hashslots_free_rcu);
+}
+
+/*
+  Start or finish a resize. Does nothing if another thread is
+  currently doing so, in which case a later operation will retry.
+*/
+static void hashtable_rebalance(struct hashtable *ht)
+{
+    unsigned int size;
+
+    if (pthread_mutex_trylock(&ht->resize_lock))
+        return;
+
+    if (ht->old_table) {
+        hashtable_finish_resize(ht);
+    } else {
+        size = hashtable_target_size(ht);
+
+        if (size != ht->table->size)
+            hashtable_start_resize(ht, size);
+    }
+    pthread_mutex_unlock(&ht->resize_lock);
+}
+
+static void hashtable_enter(struct hashtable *ht)
+{
+    epoch_enter();
+}
+
+/*
+  Leave a table operation, doing a share of the migration work on the
+  way out and starting or finishing a resize if needed.
+*/
+static void hashtable_exit(struct hashtable *ht)
+{
+    struct hashslots *old = load_acquire(&ht->old_table);
+    int rebalance;
+
+    if (old) {
+        hashtable_migrate(ht, HTABLE_MIGRATE_STEP);
+        rebalance = (unsigned int)atomic_read(&old->migrated) == old->size;
+    } else {
+        rebalance = hashtable_target_size(ht) !=
+            load_acquire(&ht->table)->size;
+    }
+
+    epoch_exit();
+
+    if (rebalance)
+        hashtable_rebalance(ht);
+}
+
+/*
+  Finish any ongoing resize so that all elements are found in the
+  current table. Must be called with the resize lock held and outside
+  of an epoch.
+*/
+static void hashtable_migrate_all(struct hashtable *ht)
+{
+    struct hashslots *old = ht->old_table;
+
+    if (!old)
+        return;
+
+    if (old->migrate_state == MIGRATE_GRACE) {
+        epoch_synchronize();
+        store_release(&old->migrate_state, MIGRATE_READY);
+    }
+
+    hashtable_migrate(ht, old->size);
+
+    /* Other threads may still be moving the buckets they claimed */
+    while ((unsigned int)atomic_read(&old->migrated) != old->size)
+        sched_yield();
+
+    hashtable_finish_resize(ht);
+}
+
+/*
+  Get the slot that holds elements with the given hash. Must be called
+  with the slot lock held by the caller, e.g., from within a foreach
+  action.
+*/
+static struct hashslot *get_slot(struct hashtable *ht,
+                                 unsigned int hash)
+{
+    if (ht->old_table) {
+        struct hashslot *slot;
+
+        slot = hashslot_at(ht->old_table, hash & ht->old_table->mask);
+
+        if (!slot->migrated)
+            return slot;
+    }
+    return hashslot_at(ht->table, hash & ht->table->mask);
+}
+
+/*
+  Get and lock the slot that holds elements with the given hash. Must
+  be called within an epoch. A slot that is found migrated once
+  locked no longer holds any elements, in which case the lookup is
+  retried with the current tables.
+*/
+static struct hashslot *lock_slot(struct hashtable *ht,
+                                  unsigned int hash, int write)
+{
+    struct hashslots *old, *hs;
+    struct hashslot *slot;
+
+retry:
+    old = load_acquire(&ht->old_table);
+
+    if (old) {
+        slot = hashslot_at(old, hash & old->mask);
+        slot_lock(ht, slot, hash, write);
+
+        if (!slot->migrated)
+            return slot;
+
+        slot_unlock(ht, slot, hash);
+    }
+
+    hs = load_acquire(&ht->table);
+
+    /* A resize started after we loaded the old table, and the
+     * elements may still be in the previous table */
+    if (load_acquire(&ht->old_table) != old)
+        goto retry;
+
+    slot = hashslot_at(hs, hash & hs->mask);
+    slot_lock(ht, slot, hash, write);
+
+    if (slot->migrated) {
+        slot_unlock(ht, slot, hash);
+        goto retry;
+    }
+    return slot;
+}
+
+struct foreach_work {
+    struct hashtable *ht;
+    void (*action)(struct hashelm *, void *);
+    void *data;
+    unsigned int flags;
+    atomic_t next; /* Next chunk of slots to visit */
+    atomic_t count; /* Number of elements visited */
+};
+
+/*
+  Take references to all elements in a bucket so that the action can
+  run without the slot lock. Returns the number of elements, or -1 if
+  the snapshot array could not be grown.
+*/
+static int snapshot_slot(struct hashslot *slot, struct hashelm ***snap,
+                         unsigned int *size)
+{
+    struct hashelm *he;
+    unsigned int n = 0;
+
+    list_foreach(he, &slot->head, list)
+        n++;
+
+    if (n > *size) {
+        struct hashelm **s = realloc(*snap, sizeof(*s) * n);
+
+        if (!s)
+            return -1;
+
+        *snap = s;
+        *size = n;
+    }
+
+    n = 0;
+
+    list_foreach(he, &slot->head, list) {
+        hashelm_hold(he);
+        (*snap)[n++] = he;
+    }
 
-        pthread_rwlock_unlock(&ht->table[i].lock);
-	}
     return n;
 }
 
-int hashtable_foreach_read(struct hashtable *ht, 
-                           void (*action)(struct hashelm *, void *), 
-                           void *data)
+static void *foreach_worker(void *arg)
 {
-    int n = 0;
-    unsigned i;
+    struct foreach_work *w = arg;
+    struct hashtable *ht = w->ht;
+    struct hashslots *hs = ht->table;
+    struct hashelm **snap = NULL;
+    unsigned int size = 0;
+    int write = !(w->flags & (HTABLE_FOREACH_READ | HTABLE_FOREACH_UNLOCKED));
+
+    while (1) {
+        unsigned int i, end;
+        int n = 0;
+
+        i = (atomic_inc(&w->next) - 1) * HTABLE_FOREACH_CHUNK;
+
+        if (i >= hs->size)
+            break;
+
+        end = i + HTABLE_FOREACH_CHUNK;
+
+        if (end > hs->size)
+            end = hs->size;
+
+        for (; i < end; i++) {
+            struct hashslot *slot = hashslot_at(hs, i);
+            struct hashelm *he, *tmp;
+            int j, m = -1;
+
+            slot_lock(ht, slot, i, write);
+
+            if (w->flags & HTABLE_FOREACH_UNLOCKED)
+                m = snapshot_slot(slot, &snap, &size);
+
+            /* Without a snapshot, run the action under the lock */
+            if (m == -1) {
+                list_foreach_safe(he, tmp, &slot->head, list) {
+                    w->action(he, w->data);
+                    n++;
+                }
+            }
+
+            slot_unlock(ht, slot, i);
+
+            for (j = 0; j < m; j++) {
+                w->action(snap[j], w->data);
+                hashelm_put(snap[j]);
+                n++;
+            }
+        }
+
+        atomic_add(&w->count, n);
+    }
+
+    free(snap);
+
+    return NULL;
+}
+
+int hashtable_foreach_parallel(struct hashtable *ht, unsigned int nthreads,
+                               void (*action)(struct hashelm *, void *),
+                               void *data, unsigned int flags)
+{
+    struct foreach_work w;
+    pthread_t *threads = NULL;
+    unsigned int i, started = 0;
 
     if (!action)
         return -1;
 
-    for (i = 0; i <= ht->mask; i++) {
-        struct hashelm *he;
-        
-        pthread_rwlock_rdlock(&ht->table[i].lock);
-        
-        list_foreach(he, &ht->table[i].head, list) {
-            action(he, data);
-            n++;
+    w.ht = ht;
+    w.action = action;
+    w.data = data;
+    w.flags = flags;
+    atomic_set(&w.next, 0);
+    atomic_set(&w.count, 0);
+
+    if (nthreads > 1)
+        threads = malloc(sizeof(pthread_t) * (nthreads - 1));
+
+    /* Keep the table from being resized while we traverse it */
+    pthread_mutex_lock(&ht->resize_lock);
+    hashtable_migrate_all(ht);
+
+    /* The calling thread is one of the workers. If threads cannot be
+     * created, those that were do the remaining work */
+    if (threads) {
+        for (i = 0; i < nthreads - 1; i++) {
+            if (pthread_create(&threads[started], NULL,
+                               foreach_worker, &w))
+                break;
+            started++;
         }
+    }
 
-        pthread_rwlock_unlock(&ht->table[i].lock);
-	}
-    return n;
+    foreach_worker(&w);
+
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_unlock(&ht->resize_lock);
+    free(threads);
+
+    return atomic_read(&w.count);
+}
+
+int hashtable_foreach(struct hashtable *ht,
+                      void (*action)(struct hashelm *, void *),
+                      void *data)
+{
+    return hashtable_foreach_parallel(ht, 1, action, data, 0);
+}
+
+int hashtable_foreach_read(struct hashtable *ht,
+                           void (*action)(struct hashelm *, void *),
+                           void *data)
+{
+    return hashtable_foreach_parallel(ht, 1, action, data,
+                                      HTABLE_FOREACH_READ);
 }
 
 unsigned int hashtable_count(struct hashtable *ht)
@@ -126,66 +815,137 @@ unsigned int hashtable_count(struct hashtable *ht)
     return atomic_read(&ht->count);
 }
 
-static struct hashslot *get_slot(struct hashtable *tbl,
-                                 unsigned int hash)
+int hashelm_hashed(struct hashelm *he)
 {
-    return &tbl->table[hash & tbl->mask];
+    /* Elements removed from HTABLE_F_RCU tables keep their next
+     * pointer for concurrent readers, so check the previous one */
+    return he->list.prev != &he->list;
 }
 
-int hashelm_hashed(struct hashelm *he)
+int hashelm_wait_grace(struct hashelm *he)
 {
-    return !list_empty(&he->list);
+    /* An element unhashed from an HTABLE_F_RCU table may still have
+     * lock-free readers on it, which relinking would lead astray, and
+     * its entry is queued for the deferred release. Wait for the
+     * release, unless that would wait for ourselves. */
+    if (load_acquire(&he->grace)) {
+        if (epoch_in_section()) {
+            LOG_ERR("Hash element unhashed in the current grace period\n");
+            return -1;
+        }
+
+        while (load_acquire(&he->grace))
+            epoch_synchronize();
+    }
+    return 0;
 }
 
-int hashtable_hash(struct hashtable *ht, struct hashelm *he, 
-                   const void *key)
+/*
+  Find the element with the given key in a locked slot.
+*/
+static struct hashelm *slot_find(struct hashtable *ht, struct hashslot *slot,
+                                 const void *key, unsigned int hash)
 {
-    struct hashslot *slot;
-    struct hashelm *he2;
+    struct hashelm *he;
+
+    list_foreach(he, &slot->head, list) {
+        if (he->hash == hash && ht->equalfn(he, key))
+            return he;
+    }
+    return NULL;
+}
+
+/*
+  Add an element to a locked slot, taking the table's reference.
+*/
+static void slot_insert(struct hashtable *ht, struct hashslot *slot,
+                        struct hashelm *he)
+{
+    atomic_inc(&ht->count);
+    hashelm_hold(he);
+
+    if (ht->flags & HTABLE_F_RCU)
+        list_add_front_rcu(&slot->head, &he->list);
+    else
+        list_add_front(&slot->head, &he->list);
+}
 
-    if (!list_empty(&he->list)) {
+static int hashelm_prepare(struct hashtable *ht, struct hashelm *he,
+                           const void *key)
+{
+    if (hashelm_hashed(he)) {
         LOG_ERR("Hash element already hashed\n");
         return -1;
     }
 
-    he->hash = ht->hashfn(key);
+    if (hashelm_wait_grace(he))
+        return -1;
+
+    he->hash = hashtable_hashkey(ht, key);
     he->ht = ht;
     he->key = key;
-    slot = get_slot(ht, he->hash);
-    pthread_rwlock_wrlock(&slot->lock);
-
-    list_foreach(he2, &slot->head, list) {
-        if (ht->equalfn(he2, key)) {
-            pthread_rwlock_unlock(&slot->lock);
-            return -1;
-        }
-    }
-    slot->count++;
-    atomic_inc(&ht->count);
-    list_add_front(&slot->head, &he->list);
-    hashelm_hold(he);
-    pthread_rwlock_unlock(&slot->lock);
 
     return 0;
 }
 
-static void __unhash(struct hashtable *ht, 
-                     struct hashslot *slot, 
+int hashtable_hash(struct hashtable *ht, struct hashelm *he,
+                   const void *key)
+{
+    struct hashslot *slot;
+    int ret = 0;
+
+    if (hashelm_prepare(ht, he, key))
+        return -1;
+
+    hashtable_enter(ht);
+    slot = lock_slot(ht, he->hash, 1);
+
+    if (slot_find(ht, slot, key, he->hash))
+        ret = -1;
+    else
+        slot_insert(ht, slot, he);
+
+    slot_unlock(ht, slot, he->hash);
+    hashtable_exit(ht);
+
+    return ret;
+}
+
+static void hashelm_put_rcu(struct epoch_entry *e)
+{
+    struct hashelm *he = epoch_entry(e, struct hashelm, rcu);
+
+    store_release(&he->grace, 0);
+    hashelm_put(he);
+}
+
+static void __unhash(struct hashtable *ht,
+                     struct hashslot *slot,
                      struct hashelm *he)
 {
-    list_del(&he->list);
-    slot->count--;
     atomic_dec(&ht->count);
-    hashelm_put(he);    
+
+    if (ht->flags & HTABLE_F_RCU) {
+        /* Lock-free readers may be on the element, so drop the
+         * table's reference only once they are all done */
+        list_del_rcu(&he->list);
+        store_release(&he->grace, 1);
+        epoch_defer(&he->rcu, hashelm_put_rcu);
+    } else {
+        list_del(&he->list);
+        hashelm_put(he);
+    }
 }
 
 void hashtable_unhash(struct hashtable *ht, struct hashelm *he)
 {
     struct hashslot *slot;
-    slot = get_slot(ht, he->hash);
-    pthread_rwlock_wrlock(&slot->lock);
+
+    hashtable_enter(ht);
+    slot = lock_slot(ht, he->hash, 1);
     __unhash(ht, slot, he);
-    pthread_rwlock_unlock(&slot->lock);
+    slot_unlock(ht, slot, he->hash);
+    hashtable_exit(ht);
 }
 
 void __hashtable_unhash(struct hashtable *ht, struct hashelm *he)
@@ -193,6 +953,85 @@ void __hashtable_unhash(struct hashtable *ht, struct hashelm *he)
     __unhash(ht, get_slot(ht, he->hash), he);
 }
 
+struct hashelm *hashtable_lookup_or_insert(struct hashtable *ht,
+                                           struct hashelm *he,
+                                           const void *key)
+{
+    struct hashslot *slot;
+    struct hashelm *he2;
+
+    if (hashelm_prepare(ht, he, key))
+        return NULL;
+
+    hashtable_enter(ht);
+    slot = lock_slot(ht, he->hash, 1);
+    he2 = slot_find(ht, slot, key, he->hash);
+
+    if (!he2) {
+        slot_insert(ht, slot, he);
+        he2 = he;
+    }
+    hashelm_hold(he2);
+
+    slot_unlock(ht, slot, he->hash);
+    hashtable_exit(ht);
+
+    return he2;
+}
+
+int hashtable_replace(struct hashtable *ht, struct hashelm *he,
+                      const void *key, struct hashelm **old)
+{
+    struct hashslot *slot;
+    struct hashelm *he2;
+
+    if (hashelm_prepare(ht, he, key))
+        return -1;
+
+    hashtable_enter(ht);
+    slot = lock_slot(ht, he->hash, 1);
+    he2 = slot_find(ht, slot, key, he->hash);
+
+    /* Link the new element first, so that lock-free readers find
+     * either of them */
+    slot_insert(ht, slot, he);
+
+    if (he2) {
+        if (old)
+            hashelm_hold(he2);
+        __unhash(ht, slot, he2);
+    }
+
+    slot_unlock(ht, slot, he->hash);
+    hashtable_exit(ht);
+
+    if (old)
+        *old = he2;
+
+    return 0;
+}
+
+struct hashelm *hashtable_remove_key(struct hashtable *ht, const void *key)
+{
+    struct hashslot *slot;
+    struct hashelm *he;
+    unsigned int hash = hashtable_hashkey(ht, key);
+
+    hashtable_enter(ht);
+    slot = lock_slot(ht, hash, 1);
+    he = slot_find(ht, slot, key, hash);
+
+    if (he) {
+        hashelm_hold(he);
+        __unhash(ht, slot, he);
+    }
+
+    slot_unlock(ht, slot, hash);
+    hashtable_exit(ht);
+
+    return he;
+}
+
 void hashelm_hold(struct hashelm *he)
 {
     atomic_inc(&he->refcount);
@@ -211,27 +1050,199 @@ int hashelm_init(struct hashelm *he)
 {
     INIT_LIST(&he->list);
     atomic_set(&he->refcount, 1);
+    he->grace = 0;
     return 0;
 }
 
-struct hashelm *hashtable_lookup(struct hashtable *ht, const void *key)
+/*
+  Walk a bucket chain without locks. Returns -1 if the table is being
+  resized, in which case chains may move and the caller has to fall
+  back to a locked lookup. Must be called within an epoch.
+*/
+static int lookup_rcu(struct hashtable *ht, const void *key,
+                      unsigned int hash, struct hashelm **hep)
+{
+    struct hashslots *hs;
+    struct hashslot *slot;
+    struct list *l;
+    unsigned int seq = 0;
+
+retry:
+    if (load_acquire(&ht->old_table))
+        return -1;
+
+    hs = load_acquire(&ht->table);
+
+    if (load_acquire(&ht->old_table))
+        return -1;
+
+    slot = hashslot_at(hs, hash & hs->mask);
+
+    if (ht->flags & HTABLE_F_LOCK_SEQ) {
+        seq = load_acquire(&slot->lock);
+
+        if (seq & 1) {
+            cpu_relax();
+            goto retry;
+        }
+    }
+
+    *hep = NULL;
+
+    for (l = load_acquire(&slot->head.next); l != &slot->head;
+         l = load_acquire(&l->next)) {
+        struct hashelm *he;
+
+        /* The element we were on was removed and rehashed into
+         * another bucket, whose anchor we just reached */
+        if ((char *)l >= hs->slot &&
+            (char *)l < hs->slot + (size_t)hs->size * hs->stride)
+            goto retry;
+
+        he = list_entry(l, struct hashelm, list);
+
+        if (he->hash == hash && ht->equalfn(he, key)) {
+            *hep = he;
+            break;
+        }
+    }
+
+    /* A writer changed the bucket while we walked it */
+    if (ht->flags & HTABLE_F_LOCK_SEQ) {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&slot->lock, __ATOMIC_RELAXED) != seq)
+            goto retry;
+    }
+
+    return 0;
+}
+
+static struct hashelm *lookup_locked(struct hashtable *ht, const void *key,
+                                     unsigned int hash)
 {
     struct hashelm *he;
     struct hashslot *slot;
 
-    slot = get_slot(ht, ht->hashfn(key));
-    
-    pthread_rwlock_rdlock(&slot->lock);
-    
-    list_foreach(he, &slot->head, list) {
-        if (ht->equalfn(he, key)) {
+    slot = lock_slot(ht, hash, 0);
+    he = slot_find(ht, slot, key, hash);
+
+    if (he)
+        hashelm_hold(he);
+
+    slot_unlock(ht, slot, hash);
+
+    return he;
+}
+
+struct hashelm *hashtable_lookup(struct hashtable *ht, const void *key)
+{
+    struct hashelm *he;
+    unsigned int hash = hashtable_hashkey(ht, key);
+
+    hashtable_enter(ht);
+
+    if ((ht->flags & HTABLE_F_RCU) && lookup_rcu(ht, key, hash, &he) == 0) {
+        if (he)
             hashelm_hold(he);
-            goto found;
+    } else {
+        he = lookup_locked(ht, key, hash);
+    }
+
+    hashtable_exit(ht);
+
+    return he;
+}
+
+/*
+  Get the slot a lookup for the given hash will start from, for
+  prefetching only. Must be called within an epoch.
+*/
+static struct hashslot *peek_slot(struct hashtable *ht, unsigned int hash)
+{
+    struct hashslots *hs = load_acquire(&ht->old_table);
+
+    if (!hs)
+        hs = load_acquire(&ht->table);
+
+    return hashslot_at(hs, hash & hs->mask);
+}
+
+unsigned int hashtable_lookup_many(struct hashtable *ht,
+                                   const void *const *keys, unsigned int n,
+                                   struct hashelm **elms)
+{
+    unsigned int hashes[HTABLE_LOOKUP_BATCH];
+    struct hashslot *slots[HTABLE_LOOKUP_BATCH];
+    unsigned int i, j, batch, found = 0;
+
+    hashtable_enter(ht);
+
+    for (i = 0; i < n; i += batch) {
+        batch = n - i < HTABLE_LOOKUP_BATCH ? n - i : HTABLE_LOOKUP_BATCH;
+
+        /* Stage 1: hash all keys and start loading their slots */
+        for (j = 0; j < batch; j++) {
+            hashes[j] = hashtable_hashkey(ht, keys[i + j]);
+            slots[j] = peek_slot(ht, hashes[j]);
+            __builtin_prefetch(slots[j]);
+
+            if (!(ht->flags & (HTABLE_F_RCU | HTABLE_LOCK_MODES)))
+                __builtin_prefetch(slot_rwlock(slots[j]), 1);
+        }
+
+        /* Stage 2: start loading the first element of each chain. The
+         * unlocked read is only a hint */
+        for (j = 0; j < batch; j++)
+            __builtin_prefetch(load_acquire(&slots[j]->head.next));
+
+        /* Stage 3: resolve, by now mostly from cache */
+        for (j = 0; j < batch; j++) {
+            const void *key = keys[i + j];
+            struct hashelm *he;
+
+            if ((ht->flags & HTABLE_F_RCU) &&
+                lookup_rcu(ht, key, hashes[j], &he) == 0) {
+                if (he)
+                    hashelm_hold(he);
+            } else {
+                he = lookup_locked(ht, key, hashes[j]);
+            }
+
+            elms[i + j] = he;
+
+            if (he)
+                found++;
         }
     }
-    he = NULL;
-found:
-    pthread_rwlock_unlock(&slot->lock);
-    
+
+    hashtable_exit(ht);
+
+    return found;
+}
+
+struct hashelm *hashtable_lookup_rcu(struct hashtable *ht, const void *key)
+{
+    struct hashelm *he;
+    unsigned int hash = hashtable_hashkey(ht, key);
+
+    if (!(ht->flags & HTABLE_F_RCU)) {
+        LOG_ERR("Not an RCU hash table\n");
+        return NULL;
+    }
+
+    hashtable_enter(ht);
+
+    if (lookup_rcu(ht, key, hash, &he) == -1) {
+        /* The table's reference is only dropped after our epoch, so
+         * the element stays valid without our own */
+        he = lookup_locked(ht, key, hash);
+
+        if (he)
+            hashelm_put(he);
+    }
+
+    hashtable_exit(ht);
+
     return he;
 }
@@ -0,0 +1,108 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Test of rehashing elements in HTABLE_F_RCU tables.
+ *
+ * An element unhashed, hashed again and unhashed again within one
+ * grace period must not have its deferred release queued twice, and
+ * must not be relinked while a lock-free reader may be on it.
+ *
+ * Author: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ckit/hashtable.h>
+#include <ckit/epoch.h>
+
+struct obj {
+    struct hashelm he;
+    unsigned int key;
+};
+
+static int freed;
+static int reader_in, reader_out;
+
+#define CHECK(cond) do {                                            \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: %s failed\n",                   \
+                    __FILE__, __LINE__, #cond);                     \
+            exit(EXIT_FAILURE);                                     \
+        }                                                           \
+    } while (0)
+
+static int obj_equal(const struct hashelm *he, const void *key)
+{
+    return hashtable_entry(he, struct obj, he)->key ==
+        *(const unsigned int *)key;
+}
+
+static void obj_free(struct hashelm *he)
+{
+    freed++;
+}
+
+/*
+  Stay in a read-side section for a while, as a lock-free reader that
+  may be on an unhashed element.
+*/
+static void *reader(void *arg)
+{
+    epoch_enter();
+    __atomic_store_n(&reader_in, 1, __ATOMIC_RELEASE);
+    usleep(50000);
+    __atomic_store_n(&reader_out, 1, __ATOMIC_RELEASE);
+    epoch_exit();
+
+    return NULL;
+}
+
+int main(void)
+{
+    struct hashtable ht;
+    struct obj o = { .key = 42 };
+    pthread_t thr;
+
+    CHECK(hashtable_init_flags(&ht, 0, default_hashfn, obj_equal, obj_free,
+                               HTABLE_F_RCU) == 0);
+    hashelm_init(&o.he);
+    CHECK(hashtable_hash(&ht, &o.he, &o.key) == 0);
+
+    pthread_create(&thr, NULL, reader, NULL);
+
+    while (!__atomic_load_n(&reader_in, __ATOMIC_ACQUIRE))
+        usleep(1000);
+
+    /* Unhash, hash and unhash again while the reader is around. The
+     * second hash must wait for the reader to leave. */
+    hashtable_unhash(&ht, &o.he);
+    CHECK(hashtable_hash(&ht, &o.he, &o.key) == 0);
+    CHECK(__atomic_load_n(&reader_out, __ATOMIC_ACQUIRE));
+    hashtable_unhash(&ht, &o.he);
+
+    epoch_synchronize();
+    CHECK(atomic_read(&o.he.refcount) == 1);
+    CHECK(freed == 0);
+
+    /* From within a section, waiting is not possible */
+    CHECK(hashtable_hash(&ht, &o.he, &o.key) == 0);
+    epoch_enter();
+    hashtable_unhash(&ht, &o.he);
+    CHECK(hashtable_hash(&ht, &o.he, &o.key) == -1);
+    epoch_exit();
+
+    epoch_synchronize();
+    CHECK(hashtable_hash(&ht, &o.he, &o.key) == 0);
+    CHECK(hashtable_count(&ht) == 1);
+    hashtable_unhash(&ht, &o.he);
+
+    pthread_join(thr, NULL);
+    hashtable_fini(&ht);
+
+    CHECK(atomic_read(&o.he.refcount) == 1);
+    CHECK(freed == 0);
+
+    printf("OK\n");
+
+    return EXIT_SUCCESS;
+}
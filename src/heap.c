@@ -2,36 +2,74 @@
  *
  * A simple heap implementation.
  *
+ * The heap is d-ary: the children of item i are at indexes d * i + 1
+ * to d * i + d. The item array is placed so that the first group of
+ * siblings starts on a cache line boundary. When d * sizeof(void *)
+ * divides the line size, i.e., for arities 2, 4 and 8 with 64-bit
+ * pointers, every later group then lies within a single line, and
+ * finding the smallest child costs at most one cache miss into the
+ * array. Other arities get no such guarantee, as their groups may
+ * straddle two lines.
+ *
  * Author: Erik Nordström <erik.nordstrom@gmail.com>
  *
  */
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <ckit/heap.h>
 
 #define HEAP_DEFAULT_SIZE 200
-#define HEAP_DEFAULT_INCREASE_SIZE 100
+#define HEAP_CACHE_LINE 64
 
-int heap_init(struct heap *h, unsigned int max_size, 
-              int (*cmp)(const struct heapitem *i1, const struct heapitem *i2))
+/*
+  Allocate an item array with room for 'size' items, offset so that
+  the first child of the root (index 1) is cache line aligned. Later
+  sibling groups are then aligned to their own size, which keeps each
+  within one line only if that size divides the line size.
+*/
+static int heap_alloc(struct heap *h, unsigned int size)
+{
+    void *mem;
+
+    if (posix_memalign(&mem, HEAP_CACHE_LINE,
+                       HEAP_CACHE_LINE + sizeof(struct heapitem *) * size))
+        return -1;
+
+    h->mem = mem;
+    h->map = (struct heapitem **)((char *)mem + HEAP_CACHE_LINE -
+                                  sizeof(struct heapitem *));
+    h->max_size = size;
+
+    return 0;
+}
+
+int heap_init_arity(struct heap *h, unsigned int max_size, unsigned int arity,
+                    int (*cmp)(const struct heapitem *i1, const struct heapitem *i2))
 {
     if (max_size == 0)
         max_size = HEAP_DEFAULT_SIZE;
 
-	h->max_size = max_size;
-	h->size = 0;
-    h->cmp = cmp;
-	h->map = malloc(sizeof(struct heapitem *) * max_size); 
-    
-    if (!h->map)
+    if (arity < 2 || arity > HEAP_MAX_ARITY)
         return -1;
 
-    return 0;
+    h->size = 0;
+    h->arity = arity;
+    h->shrink = 0;
+    h->cmp = cmp;
+
+    return heap_alloc(h, max_size);
+}
+
+int heap_init(struct heap *h, unsigned int max_size, 
+              int (*cmp)(const struct heapitem *i1, const struct heapitem *i2))
+{
+    return heap_init_arity(h, max_size, 2, cmp);
 }
 	
 void heap_fini(struct heap *h)
 { 
-	free(h->map);
+	free(h->mem);
 }
 
 int heap_empty(struct heap *h)
@@ -53,84 +91,183 @@ unsigned int heap_size(struct heap *h)
 { 
 	return h->size; 
 }
-	
-static void heap_heapify(struct heap *h, unsigned int i)
+
+/*
+  Move an item towards the root until its parent is not greater, and
+  store it at its final position.
+*/
+static void heap_sift_up(struct heap *h, unsigned int i,
+                         struct heapitem *item)
+{
+    while (i > 0) {
+        unsigned int parent = (i - 1) / h->arity;
+
+        if (!h->cmp(item, h->map[parent]))
+            break;
+
+        h->map[i] = h->map[parent];
+        h->map[i]->index = i;
+        i = parent;
+    }
+    h->map[i] = item;
+    item->index = i;
+}
+
+/*
+  Move an item towards the leaves until no child is smaller, and
+  store it at its final position.
+*/
+static void heap_sift_down(struct heap *h, unsigned int i,
+                           struct heapitem *item)
 {
-	unsigned int l, r, smallest;
-	struct heapitem *tmp;
+    while (1) {
+        unsigned int c, first = h->arity * i + 1, last, smallest;
+
+        if (first >= h->size)
+            break;
+
+        last = first + h->arity;
 
-	l = (2 * i) + 1;	/* left child */
-	r = l + 1;		/* right child */
-    
-	if ((l < h->size) && h->cmp(h->map[l], h->map[i]))
-		smallest = l;
-	else
-		smallest = i;
+        if (last > h->size)
+            last = h->size;
 
-	if ((r < h->size) && h->cmp(h->map[r], h->map[smallest]))
-		smallest = r;
+        smallest = first;
 
-	if (smallest == i)
-		return;
+        for (c = first + 1; c < last; c++) {
+            if (h->cmp(h->map[c], h->map[smallest]))
+                smallest = c;
+        }
 
-	/* exchange to maintain heap property */
-	tmp = h->map[smallest];
-	h->map[smallest] = h->map[i];
-	h->map[smallest]->index = smallest;
-	h->map[i] = tmp;
-	h->map[i]->index = i;
-	heap_heapify(h, smallest);
+        if (!h->cmp(h->map[smallest], item))
+            break;
+
+        h->map[i] = h->map[smallest];
+        h->map[i]->index = i;
+        i = smallest;
+    }
+    h->map[i] = item;
+    item->index = i;
+}
+
+/*
+  Store an item at the given index, sifting it in whichever direction
+  restores heap order.
+*/
+static void heap_restore(struct heap *h, unsigned int i,
+                         struct heapitem *item)
+{
+    if (i > 0 && h->cmp(item, h->map[(i - 1) / h->arity]))
+        heap_sift_up(h, i, item);
+    else
+        heap_sift_down(h, i, item);
 }
 
-static int heap_increase_size(struct heap *h, unsigned int increase_size)
+/*
+  Move the items to a new array with room for 'size' items.
+*/
+static int heap_resize(struct heap *h, unsigned int size)
 {
-    struct heapitem **new_map;
-    
-	new_map = malloc((h->max_size + increase_size) * 
-                     sizeof(struct heapitem *));
+    struct heapitem **old_map = h->map;
+    void *old_mem = h->mem;
 
-	if (!new_map)
+    if (heap_alloc(h, size)) {
+        h->map = old_map;
+        h->mem = old_mem;
         return -1;
+    }
 
-	memcpy(new_map, h->map, h->size * sizeof(struct heapitem *));
+	memcpy(h->map, old_map, h->size * sizeof(struct heapitem *));
 
-    free(h->map);
+    free(old_mem);
 
-	h->map = new_map;
+	return 0;
+}
 
-	h->max_size += increase_size;
+int heap_reserve(struct heap *h, unsigned int size)
+{
+    unsigned int max_size = h->max_size;
 
-	return 0;
+    if (size <= max_size)
+        return 0;
+
+    /* Grow geometrically so that a series of inserts copies each
+     * item a constant number of times on average */
+    while (max_size < size) {
+        if (max_size > UINT_MAX / 2)
+            return heap_resize(h, size);
+        max_size *= 2;
+    }
+
+    return heap_resize(h, max_size);
 }
 
 int heap_insert(struct heap *h, struct heapitem *item)
 {
-	unsigned int i, parent;
-    
 	if (heap_full(h)) {
-		if (heap_increase_size(h, HEAP_DEFAULT_INCREASE_SIZE)) {
+		if (heap_reserve(h, h->size + 1)) {
             return -1;
 		}
 	}
 
-	i = h->size;
-	parent = (i - 1) / 2;
-
-	/* find the correct place to insert */
-	while ((i > 0) && h->cmp(h->map[parent], item)) {
-		h->map[i] = h->map[parent];
-		h->map[i]->index = i;
-		i = parent;
-		parent = (i - 1) / 2;
-	}
-	h->map[i] = item;
-	item->index = i;
-	h->size++;
+	heap_sift_up(h, h->size++, item);
     item->active = 1;
 
 	return 0;
 }
 
+/*
+  Establish heap order over the whole array bottom-up (Floyd's
+  method), which takes linear time.
+*/
+static void heap_heapify(struct heap *h)
+{
+    unsigned int i;
+
+    if (h->size < 2)
+        return;
+
+    for (i = (h->size - 2) / h->arity + 1; i-- > 0;)
+        heap_sift_down(h, i, h->map[i]);
+}
+
+int heap_insert_many(struct heap *h, struct heapitem **items, unsigned int n)
+{
+    unsigned int i, size = h->size;
+
+    if (heap_reserve(h, h->size + n))
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        h->map[size + i] = items[i];
+        items[i]->index = size + i;
+        items[i]->active = 1;
+    }
+    h->size += n;
+
+    /* Sifting up is cheaper than rebuilding for a few items */
+    if (n < size) {
+        for (i = size; i < h->size; i++)
+            heap_sift_up(h, i, h->map[i]);
+    } else {
+        heap_heapify(h);
+    }
+
+    return 0;
+}
+
+int heap_build(struct heap *h, struct heapitem **items, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < h->size; i++) {
+        h->map[i]->index = 0;
+        h->map[i]->active = 0;
+    }
+    h->size = 0;
+
+    return heap_insert_many(h, items, n);
+}
+
 struct heapitem *heap_remove(struct heap *h, unsigned int index)
 {
     struct heapitem *item;
@@ -140,10 +277,22 @@ struct heapitem *heap_remove(struct heap *h, unsigned int index)
 
     item = h->map[index];
     h->size--;
-	h->map[index] = h->map[h->size];
-	heap_heapify(h, index);
+
+    /* The last item may belong above or below the hole */
+    if (index < h->size)
+        heap_restore(h, index, h->map[h->size]);
+
     item->index = 0;
     item->active = 0;
 
+    if (h->shrink && h->max_size > HEAP_DEFAULT_SIZE &&
+        h->size < h->max_size / 4)
+        heap_resize(h, h->max_size / 2);
+
     return item;
 }
+
+void heap_update(struct heap *h, struct heapitem *item)
+{
+    heap_restore(h, item->index, item);
+}
@@ -0,0 +1,408 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Benchmark of the heaps on timer workloads.
+ *
+ * Compares the comparator-based heap, the keyed heap, the radix heap
+ * and a timing wheel with 1 ms ticks on a queue of timers with
+ * deadlines in nanoseconds:
+ *
+ *   expire: every timer expires and is rescheduled, like periodic
+ *           timers.
+ *   cancel: new timers are added continuously, and most are cancelled
+ *           before they expire, like retransmission timers.
+ *
+ * Then, through a struct timer_queue with each backend:
+ *
+ *   ordered: all timers are cancelled in deadline order, so that each
+ *            cancel removes the first timer, like timeouts of
+ *            requests that complete in the order they were sent.
+ *
+ * Timeouts are a mix of short (up to 1 ms), medium (up to 200 ms)
+ * and long (up to 30 s) ones.
+ *
+ * Usage: heap_bench [timers] [operations]
+ *
+ * Author: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <ckit/heap.h>
+#include <ckit/keyheap.h>
+#include <ckit/radixheap.h>
+#include <ckit/timerwheel.h>
+#include <ckit/timer.h>
+
+struct bench_timer {
+    union {
+        struct heapitem hi;
+        struct radixitem ri;
+        struct wheelitem wi;
+    };
+    uint64_t deadline;
+    void *data[4]; /* Pad to about the size of a struct timer */
+};
+
+struct bench_ops {
+    const char *name;
+    void (*init)(void);
+    void (*fini)(void);
+    void (*insert)(struct bench_timer *t);
+    void (*remove)(struct bench_timer *t);
+    struct bench_timer *(*remove_first)(void);
+};
+
+static struct heap heap;
+static struct keyheap keyheap;
+static struct radixheap radixheap;
+static struct timerwheel timerwheel;
+static uint64_t rng = 88172645463325252ULL;
+
+static inline uint64_t rand64(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static uint64_t timeout(void)
+{
+    uint64_t r = rand64();
+
+    switch (r % 4) {
+    case 0:
+        return (r >> 8) % 1000000ULL;
+    case 1:
+    case 2:
+        return (r >> 8) % 200000000ULL;
+    default:
+        return (r >> 8) % 30000000000ULL;
+    }
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int heap_cmp(const struct heapitem *i1, const struct heapitem *i2)
+{
+    return heap_entry(i1, struct bench_timer, hi)->deadline <
+        heap_entry(i2, struct bench_timer, hi)->deadline;
+}
+
+static void heap_bench_init(void)
+{
+    heap_init(&heap, 0, heap_cmp);
+}
+
+static void heap_bench_fini(void)
+{
+    heap_fini(&heap);
+}
+
+static void heap_bench_insert(struct bench_timer *t)
+{
+    heap_insert(&heap, &t->hi);
+}
+
+static void heap_bench_remove(struct bench_timer *t)
+{
+    heap_remove(&heap, t->hi.index);
+}
+
+static struct bench_timer *heap_bench_remove_first(void)
+{
+    return heap_remove_first_entry(&heap, struct bench_timer, hi);
+}
+
+static void keyheap_bench_init(void)
+{
+    keyheap_init(&keyheap, 0);
+}
+
+static void keyheap_bench_fini(void)
+{
+    keyheap_fini(&keyheap);
+}
+
+static void keyheap_bench_insert(struct bench_timer *t)
+{
+    keyheap_insert(&keyheap, &t->hi, t->deadline);
+}
+
+static void keyheap_bench_remove(struct bench_timer *t)
+{
+    keyheap_remove(&keyheap, t->hi.index);
+}
+
+static struct bench_timer *keyheap_bench_remove_first(void)
+{
+    return keyheap_remove_first_entry(&keyheap, struct bench_timer, hi);
+}
+
+static void radixheap_bench_init(void)
+{
+    radixheap_init(&radixheap);
+}
+
+static void radixheap_bench_fini(void)
+{
+}
+
+static void radixheap_bench_insert(struct bench_timer *t)
+{
+    radixheap_insert(&radixheap, &t->ri, t->deadline);
+}
+
+static void radixheap_bench_remove(struct bench_timer *t)
+{
+    radixheap_remove(&radixheap, &t->ri);
+}
+
+static struct bench_timer *radixheap_bench_remove_first(void)
+{
+    return radixheap_entry(radixheap_remove_first(&radixheap),
+                           struct bench_timer, ri);
+}
+
+static void timerwheel_bench_init(void)
+{
+    timerwheel_init(&timerwheel, 1000000);
+}
+
+static void timerwheel_bench_fini(void)
+{
+}
+
+static void timerwheel_bench_insert(struct bench_timer *t)
+{
+    timerwheel_add(&timerwheel, &t->wi, t->deadline);
+}
+
+static void timerwheel_bench_remove(struct bench_timer *t)
+{
+    timerwheel_del(&timerwheel, &t->wi);
+}
+
+static struct bench_timer *timerwheel_bench_remove_first(void)
+{
+    return timerwheel_entry(timerwheel_remove_first(&timerwheel),
+                            struct bench_timer, wi);
+}
+
+static const struct bench_ops benches[] = {
+    { "heap", heap_bench_init, heap_bench_fini, heap_bench_insert,
+      heap_bench_remove, heap_bench_remove_first },
+    { "keyheap", keyheap_bench_init, keyheap_bench_fini,
+      keyheap_bench_insert, keyheap_bench_remove,
+      keyheap_bench_remove_first },
+    { "radixheap", radixheap_bench_init, radixheap_bench_fini,
+      radixheap_bench_insert, radixheap_bench_remove,
+      radixheap_bench_remove_first },
+    { "timerwheel", timerwheel_bench_init, timerwheel_bench_fini,
+      timerwheel_bench_insert, timerwheel_bench_remove,
+      timerwheel_bench_remove_first },
+};
+
+/*
+  Expire the first timer and reschedule it, advancing the clock to
+  its deadline.
+*/
+static double bench_expire(const struct bench_ops *ops,
+                           struct bench_timer *timers, unsigned int n,
+                           unsigned long nops)
+{
+    uint64_t clock = 0, start;
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        timers[i].deadline = timeout();
+        ops->insert(&timers[i]);
+    }
+
+    start = now_ns();
+
+    for (i = 0; i < nops; i++) {
+        struct bench_timer *t = ops->remove_first();
+
+        clock = t->deadline;
+        t->deadline = clock + timeout();
+        ops->insert(t);
+    }
+
+    return (double)(now_ns() - start) / nops;
+}
+
+/*
+  Schedule a timer and then either cancel a random timer or, one time
+  in ten, expire the first one.
+*/
+static double bench_cancel(const struct bench_ops *ops,
+                           struct bench_timer *timers, unsigned int n,
+                           unsigned long nops)
+{
+    struct bench_timer **idle;
+    uint64_t clock = 0, start;
+    unsigned int nidle = n / 2;
+    unsigned long i;
+
+    idle = malloc(sizeof(*idle) * nidle);
+
+    if (!idle)
+        return 0;
+
+    for (i = 0; i < n; i++) {
+        if (i < nidle) {
+            idle[i] = &timers[i];
+            continue;
+        }
+        timers[i].deadline = timeout();
+        ops->insert(&timers[i]);
+    }
+
+    start = now_ns();
+
+    for (i = 0; i < nops; i++) {
+        struct bench_timer *t;
+        unsigned int j = rand64() % nidle;
+
+        t = idle[j];
+        t->deadline = clock + timeout();
+        ops->insert(t);
+
+        if (rand64() % 10 == 0) {
+            t = ops->remove_first();
+            clock = t->deadline;
+        } else {
+            do {
+                t = &timers[rand64() % n];
+            } while (!t->hi.active);
+            ops->remove(t);
+        }
+        idle[j] = t;
+    }
+
+    free(idle);
+
+    return (double)(now_ns() - start) / nops;
+}
+
+static int timer_cmp(const void *a, const void *b)
+{
+    const struct timer *t1 = *(struct timer *const *)a;
+    const struct timer *t2 = *(struct timer *const *)b;
+
+    if (t1->timeout.tv_sec != t2->timeout.tv_sec)
+        return t1->timeout.tv_sec < t2->timeout.tv_sec ? -1 : 1;
+
+    return (t1->timeout.tv_nsec > t2->timeout.tv_nsec) -
+        (t1->timeout.tv_nsec < t2->timeout.tv_nsec);
+}
+
+/*
+  Schedule 'n' timers on a timer queue and cancel them in deadline
+  order.
+*/
+static double bench_queue_ordered(enum timer_backend backend, unsigned int n)
+{
+    struct timer_queue tq;
+    struct timer *timers, **order;
+    uint64_t start;
+    unsigned int i;
+    double ns = 0;
+
+    timers = calloc(n, sizeof(*timers));
+    order = malloc(sizeof(*order) * n);
+
+    if (!timers || !order || timer_queue_init_backend(&tq, backend)) {
+        free(timers);
+        free(order);
+        return 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        timer_init(&timers[i]);
+        timers[i].expires = timeout() / 1000;
+        timer_add(&tq, &timers[i]);
+        order[i] = &timers[i];
+    }
+
+    qsort(order, n, sizeof(*order), timer_cmp);
+
+    start = now_ns();
+
+    for (i = 0; i < n; i++)
+        timer_del(&tq, order[i]);
+
+    ns = (double)(now_ns() - start) / n;
+
+    timer_queue_fini(&tq);
+    free(timers);
+    free(order);
+
+    return ns;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int n = argc > 1 ? atoi(argv[1]) : 100000;
+    unsigned long nops = argc > 2 ? atol(argv[2]) : 5000000;
+    struct bench_timer *timers;
+    unsigned int i;
+
+    if (n < 2) {
+        fprintf(stderr, "Need at least two timers\n");
+        return EXIT_FAILURE;
+    }
+
+    timers = calloc(n, sizeof(*timers));
+
+    if (!timers)
+        return EXIT_FAILURE;
+
+    printf("%u timers, %lu operations\n", n, nops);
+
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        const struct bench_ops *ops = &benches[i];
+        double expire, cancel;
+        unsigned int j;
+
+        rng = 88172645463325252ULL;
+        ops->init();
+        expire = bench_expire(ops, timers, n, nops);
+        ops->fini();
+
+        for (j = 0; j < n; j++)
+            timers[j].hi.active = 0;
+
+        rng = 88172645463325252ULL;
+        ops->init();
+        cancel = bench_cancel(ops, timers, n, nops);
+        ops->fini();
+
+        for (j = 0; j < n; j++)
+            timers[j].hi.active = 0;
+
+        printf("%-10s expire %7.1f ns/op  cancel %7.1f ns/op\n",
+               ops->name, expire, cancel);
+    }
+
+    printf("timer queue, cancelled in deadline order:\n");
+    printf("%-10s ordered %7.1f ns/op\n", "heap",
+           bench_queue_ordered(TIMER_BACKEND_HEAP, n));
+    printf("%-10s ordered %7.1f ns/op\n", "radix",
+           bench_queue_ordered(TIMER_BACKEND_RADIX, n));
+    printf("%-10s ordered %7.1f ns/op\n", "wheel",
+           bench_queue_ordered(TIMER_BACKEND_WHEEL, n));
+
+    free(timers);
+
+    return EXIT_SUCCESS;
+}
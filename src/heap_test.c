@@ -0,0 +1,100 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Test of heap ordering for every arity.
+ *
+ * Items inserted in descending order must each sift up to the root,
+ * and items whose key changes in place must be moved by
+ * heap_update() in either direction. After each step, the items must
+ * come off the heap in key order.
+ *
+ * Author: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <ckit/heap.h>
+
+#define NITEMS 1000
+
+struct item {
+    struct heapitem hi;
+    unsigned int key;
+};
+
+#define CHECK(cond) do {                                            \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: %s failed\n",                   \
+                    __FILE__, __LINE__, #cond);                     \
+            exit(EXIT_FAILURE);                                     \
+        }                                                           \
+    } while (0)
+
+static struct item items[NITEMS];
+
+static int item_cmp(const struct heapitem *i1, const struct heapitem *i2)
+{
+    return heap_entry(i1, struct item, hi)->key <
+        heap_entry(i2, struct item, hi)->key;
+}
+
+/*
+  Empty the heap, checking that items come off in key order.
+*/
+static void check_order(struct heap *h)
+{
+    unsigned int n = 0, prev = 0;
+
+    while (!heap_empty(h)) {
+        struct item *it = heap_remove_first_entry(h, struct item, hi);
+
+        CHECK(it->key >= prev);
+        prev = it->key;
+        n++;
+    }
+    CHECK(n == NITEMS);
+}
+
+static void test_arity(unsigned int arity)
+{
+    struct heap h;
+    unsigned int i;
+
+    CHECK(heap_init_arity(&h, 0, arity, item_cmp) == 0);
+
+    /* Every insert becomes the new first item */
+    for (i = 0; i < NITEMS; i++) {
+        items[i].key = NITEMS - i;
+        CHECK(heap_insert(&h, &items[i].hi) == 0);
+        CHECK(heap_front(&h) == &items[i].hi);
+    }
+    check_order(&h);
+
+    for (i = 0; i < NITEMS; i++) {
+        items[i].key = rand() % NITEMS;
+        CHECK(heap_insert(&h, &items[i].hi) == 0);
+    }
+
+    /* Move items both towards the root and away from it */
+    for (i = 0; i < NITEMS; i++) {
+        struct item *it = &items[rand() % NITEMS];
+
+        it->key = i % 2 ? it->key / 2 : it->key * 2 + 1;
+        heap_update(&h, &it->hi);
+    }
+    check_order(&h);
+
+    heap_fini(&h);
+}
+
+int main(void)
+{
+    unsigned int arity;
+
+    srand(1);
+
+    for (arity = 2; arity <= HEAP_MAX_ARITY; arity++)
+        test_arity(arity);
+
+    printf("OK\n");
+
+    return EXIT_SUCCESS;
+}
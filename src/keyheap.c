@@ -0,0 +1,277 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * A 4-ary heap of integer keys and item pointers.
+ *
+ * Entries are 16 bytes, and the array is placed so that the four
+ * children of each entry share one cache line. Finding the smallest
+ * child thus costs at most one cache miss and no pointer
+ * dereferences.
+ *
+ * Defining KEYHEAP_SIMD when building for AVX2 finds the smallest of
+ * four children with vector compares instead of a chain of scalar
+ * ones. This helps small, cache-resident heaps, but the longer
+ * dependency chain makes it slower once the heap misses the cache, so
+ * it is off by default.
+ *
+ * Author: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <ckit/keyheap.h>
+#if defined(KEYHEAP_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#define KEYHEAP_DEFAULT_SIZE 200
+#define KEYHEAP_CACHE_LINE 64
+
+/*
+  Allocate an entry array with room for 'size' items, offset so that
+  the first child of the root (index 1) is cache line aligned.
+*/
+static int keyheap_alloc(struct keyheap *kh, unsigned int size)
+{
+    void *mem;
+
+    if (posix_memalign(&mem, KEYHEAP_CACHE_LINE,
+                       KEYHEAP_CACHE_LINE + sizeof(struct keyheap_entry) * size))
+        return -1;
+
+    kh->mem = mem;
+    kh->map = (struct keyheap_entry *)((char *)mem + KEYHEAP_CACHE_LINE -
+                                       sizeof(struct keyheap_entry));
+    kh->max_size = size;
+
+    return 0;
+}
+
+int keyheap_init(struct keyheap *kh, unsigned int max_size)
+{
+    if (max_size == 0)
+        max_size = KEYHEAP_DEFAULT_SIZE;
+
+    kh->size = 0;
+
+    return keyheap_alloc(kh, max_size);
+}
+
+void keyheap_fini(struct keyheap *kh)
+{
+    free(kh->mem);
+}
+
+#if defined(KEYHEAP_SIMD) && defined(__AVX2__)
+/*
+  Index, among four children, of the one with the smallest key. The
+  keys are gathered from two loads and compared as signed integers
+  after flipping their top bits.
+*/
+static inline unsigned int keyheap_min4(const struct keyheap_entry *c)
+{
+    const __m256i bias = _mm256_set1_epi64x((long long)(1ULL << 63));
+    __m256i lo = _mm256_loadu_si256((const __m256i *)&c[0]);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)&c[2]);
+    /* Keys in the order 0, 2, 1, 3 */
+    __m256i k = _mm256_xor_si256(_mm256_unpacklo_epi64(lo, hi), bias);
+    __m256i idx = _mm256_set_epi64x(3, 1, 2, 0);
+    __m256i k2, idx2, gt;
+
+    /* Pairwise minimum of children 0 and 1, and of 2 and 3 */
+    k2 = _mm256_permute4x64_epi64(k, 0x4e);
+    idx2 = _mm256_permute4x64_epi64(idx, 0x4e);
+    gt = _mm256_cmpgt_epi64(k, k2);
+    k = _mm256_blendv_epi8(k, k2, gt);
+    idx = _mm256_blendv_epi8(idx, idx2, gt);
+
+    /* Minimum of the two pairs */
+    k2 = _mm256_shuffle_epi32(k, 0x4e);
+    idx2 = _mm256_shuffle_epi32(idx, 0x4e);
+    gt = _mm256_cmpgt_epi64(k, k2);
+    idx = _mm256_blendv_epi8(idx, idx2, gt);
+
+    return (unsigned int)_mm256_extract_epi64(idx, 0);
+}
+#endif
+
+/*
+  Index of the child of 'i' with the smallest key, or the heap size if
+  'i' has no children.
+*/
+static inline unsigned int keyheap_min_child(const struct keyheap *kh,
+                                             unsigned int i)
+{
+    unsigned int c, first = KEYHEAP_ARITY * i + 1, last, smallest;
+    uint64_t key;
+
+    if (first >= kh->size)
+        return kh->size;
+
+#if defined(KEYHEAP_SIMD) && defined(__AVX2__)
+    if (first + KEYHEAP_ARITY <= kh->size)
+        return first + keyheap_min4(&kh->map[first]);
+#endif
+
+    last = first + KEYHEAP_ARITY;
+
+    if (last > kh->size)
+        last = kh->size;
+
+    smallest = first;
+    key = kh->map[first].key;
+
+    for (c = first + 1; c < last; c++) {
+        if (kh->map[c].key < key) {
+            smallest = c;
+            key = kh->map[c].key;
+        }
+    }
+    return smallest;
+}
+
+/*
+  Move an entry towards the root until its parent's key is not
+  greater, and store it at its final position.
+*/
+static void keyheap_sift_up(struct keyheap *kh, unsigned int i,
+                            struct keyheap_entry e)
+{
+    while (i > 0) {
+        unsigned int parent = (i - 1) / KEYHEAP_ARITY;
+
+        if (e.key >= kh->map[parent].key)
+            break;
+
+        kh->map[i] = kh->map[parent];
+        kh->map[i].item->index = i;
+        i = parent;
+    }
+    kh->map[i] = e;
+    e.item->index = i;
+}
+
+/*
+  Move an entry towards the leaves until no child has a smaller key,
+  and store it at its final position.
+*/
+static void keyheap_sift_down(struct keyheap *kh, unsigned int i,
+                              struct keyheap_entry e)
+{
+    while (1) {
+        unsigned int smallest = keyheap_min_child(kh, i);
+
+        if (smallest == kh->size || kh->map[smallest].key >= e.key)
+            break;
+
+        kh->map[i] = kh->map[smallest];
+        kh->map[i].item->index = i;
+        i = smallest;
+    }
+    kh->map[i] = e;
+    e.item->index = i;
+}
+
+static void keyheap_restore(struct keyheap *kh, unsigned int i,
+                            struct keyheap_entry e)
+{
+    if (i > 0 && e.key < kh->map[(i - 1) / KEYHEAP_ARITY].key)
+        keyheap_sift_up(kh, i, e);
+    else
+        keyheap_sift_down(kh, i, e);
+}
+
+int keyheap_reserve(struct keyheap *kh, unsigned int size)
+{
+    struct keyheap_entry *old_map = kh->map;
+    void *old_mem = kh->mem;
+    unsigned int max_size = kh->max_size;
+
+    if (size <= max_size)
+        return 0;
+
+    while (max_size < size) {
+        if (max_size > UINT_MAX / 2) {
+            max_size = size;
+            break;
+        }
+        max_size *= 2;
+    }
+
+    if (keyheap_alloc(kh, max_size)) {
+        kh->map = old_map;
+        kh->mem = old_mem;
+        return -1;
+    }
+
+    memcpy(kh->map, old_map, kh->size * sizeof(struct keyheap_entry));
+    free(old_mem);
+
+    return 0;
+}
+
+int keyheap_insert(struct keyheap *kh, struct heapitem *item, uint64_t key)
+{
+    struct keyheap_entry e = { key, item };
+
+    if (kh->size == kh->max_size && keyheap_reserve(kh, kh->size + 1))
+        return -1;
+
+    keyheap_sift_up(kh, kh->size++, e);
+    item->active = 1;
+
+    return 0;
+}
+
+int keyheap_insert_many(struct keyheap *kh,
+                        const struct keyheap_entry *entries, unsigned int n)
+{
+    unsigned int i, size = kh->size;
+
+    if (keyheap_reserve(kh, kh->size + n))
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        kh->map[size + i] = entries[i];
+        entries[i].item->index = size + i;
+        entries[i].item->active = 1;
+    }
+    kh->size += n;
+
+    /* Sifting up is cheaper than rebuilding for a few items */
+    if (n < size) {
+        for (i = size; i < kh->size; i++)
+            keyheap_sift_up(kh, i, kh->map[i]);
+    } else if (kh->size > 1) {
+        for (i = (kh->size - 2) / KEYHEAP_ARITY + 1; i-- > 0;)
+            keyheap_sift_down(kh, i, kh->map[i]);
+    }
+
+    return 0;
+}
+
+struct heapitem *keyheap_remove(struct keyheap *kh, unsigned int index)
+{
+    struct heapitem *item;
+
+    if (index >= kh->size)
+        return NULL;
+
+    item = kh->map[index].item;
+    kh->size--;
+
+    /* The last entry may belong above or below the hole */
+    if (index < kh->size)
+        keyheap_restore(kh, index, kh->map[kh->size]);
+
+    item->index = 0;
+    item->active = 0;
+
+    return item;
+}
+
+void keyheap_update(struct keyheap *kh, struct heapitem *item, uint64_t key)
+{
+    struct keyheap_entry e = { key, item };
+
+    keyheap_restore(kh, item->index, e);
+}
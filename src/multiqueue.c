@@ -0,0 +1,263 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * MultiQueue: a concurrent priority queue of independently locked
+ * heaps.
+ *
+ * Each heap publishes its first key in 'min', which is only written
+ * under the heap's lock but read without it. Pops use these keys to
+ * choose a heap before taking its lock, and check the heap again once
+ * locked, since the key may be stale by then. Locks are only tried
+ * on the relaxed paths, so a thread that finds a heap busy moves on
+ * to another one instead of waiting.
+ *
+ * Author: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <ckit/multiqueue.h>
+#include <ckit/atomic.h>
+
+#define MULTIQUEUE_EMPTY UINT64_MAX
+
+/* Per-thread state of the random heap choices */
+static __thread uint64_t mq_rng;
+
+static inline unsigned int mq_random(unsigned int n)
+{
+    uint64_t x = mq_rng;
+
+    if (x == 0)
+        x = (uintptr_t)&mq_rng | 1;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    mq_rng = x;
+
+    return (unsigned int)((x >> 32) * n >> 32);
+}
+
+static inline int mq_trylock(struct multiqueue_heap *h)
+{
+    unsigned int v = 0;
+
+    return __atomic_compare_exchange_n(&h->lock, &v, 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void mq_lock(struct multiqueue_heap *h)
+{
+    while (__atomic_load_n(&h->lock, __ATOMIC_RELAXED) || !mq_trylock(h))
+        cpu_relax();
+}
+
+static inline void mq_unlock(struct multiqueue_heap *h)
+{
+    store_release(&h->lock, 0);
+}
+
+/*
+  Yield the CPU after every round of failed attempts, in case the
+  lock holders were preempted, e.g., with more threads than CPUs.
+*/
+static inline void mq_backoff(struct multiqueue *mq, unsigned int tries)
+{
+    if (tries % mq->nheaps == 0)
+        sched_yield();
+    else
+        cpu_relax();
+}
+
+static inline uint64_t mq_min(struct multiqueue_heap *h)
+{
+    return __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+}
+
+/*
+  Publish the heap's first key. Called with the heap locked.
+*/
+static inline void mq_set_min(struct multiqueue_heap *h)
+{
+    __atomic_store_n(&h->min, keyheap_empty(&h->heap) ? MULTIQUEUE_EMPTY :
+                     keyheap_front_key(&h->heap), __ATOMIC_RELAXED);
+}
+
+int multiqueue_init(struct multiqueue *mq, unsigned int nheaps, int flags)
+{
+    unsigned int i;
+
+    if (nheaps == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        nheaps = MULTIQUEUE_HEAPS_PER_CPU * (ncpus > 0 ? ncpus : 1);
+    }
+
+    /* Two random choices need two heaps */
+    if (nheaps < 2)
+        nheaps = 2;
+
+    if (posix_memalign((void **)&mq->heaps, 64,
+                       sizeof(*mq->heaps) * nheaps))
+        return -1;
+
+    for (i = 0; i < nheaps; i++) {
+        mq->heaps[i].lock = 0;
+        mq->heaps[i].min = MULTIQUEUE_EMPTY;
+
+        if (keyheap_init(&mq->heaps[i].heap, 0)) {
+            while (i-- > 0)
+                keyheap_fini(&mq->heaps[i].heap);
+            free(mq->heaps);
+            return -1;
+        }
+    }
+
+    mq->nheaps = nheaps;
+    mq->flags = flags;
+
+    return 0;
+}
+
+void multiqueue_fini(struct multiqueue *mq)
+{
+    unsigned int i;
+
+    for (i = 0; i < mq->nheaps; i++)
+        keyheap_fini(&mq->heaps[i].heap);
+
+    free(mq->heaps);
+}
+
+int multiqueue_insert(struct multiqueue *mq, struct heapitem *item,
+                      uint64_t key)
+{
+    struct multiqueue_heap *h;
+    unsigned int tries = 0;
+    int ret;
+
+    while (1) {
+        h = &mq->heaps[mq_random(mq->nheaps)];
+
+        if (mq_trylock(h))
+            break;
+
+        mq_backoff(mq, ++tries);
+    }
+
+    ret = keyheap_insert(&h->heap, item, key);
+
+    if (ret == 0 && key < h->min)
+        __atomic_store_n(&h->min, key, __ATOMIC_RELAXED);
+
+    mq_unlock(h);
+
+    return ret;
+}
+
+/*
+  Find the heap with the smallest first key, or NULL if all are
+  empty.
+*/
+static struct multiqueue_heap *mq_find_min(struct multiqueue *mq,
+                                           uint64_t *minp)
+{
+    struct multiqueue_heap *best = NULL;
+    uint64_t min = MULTIQUEUE_EMPTY;
+    unsigned int i;
+
+    for (i = 0; i < mq->nheaps; i++) {
+        uint64_t m = mq_min(&mq->heaps[i]);
+
+        if (m < min) {
+            min = m;
+            best = &mq->heaps[i];
+        }
+    }
+    *minp = min;
+
+    return best;
+}
+
+/*
+  Pop from a locked heap, or return NULL if it turned out empty.
+*/
+static struct heapitem *mq_pop_locked(struct multiqueue_heap *h,
+                                      uint64_t *key)
+{
+    struct heapitem *item = NULL;
+
+    if (!keyheap_empty(&h->heap)) {
+        if (key)
+            *key = keyheap_front_key(&h->heap);
+        item = keyheap_remove_first(&h->heap);
+        mq_set_min(h);
+    }
+    mq_unlock(h);
+
+    return item;
+}
+
+static struct heapitem *mq_pop_strict(struct multiqueue *mq, uint64_t *key)
+{
+    while (1) {
+        uint64_t min;
+        struct multiqueue_heap *h = mq_find_min(mq, &min);
+
+        if (!h)
+            return NULL;
+
+        mq_lock(h);
+
+        /* Pop unless the heap lost its first item meanwhile */
+        if (!keyheap_empty(&h->heap) && keyheap_front_key(&h->heap) <= min)
+            return mq_pop_locked(h, key);
+
+        mq_unlock(h);
+    }
+}
+
+static struct heapitem *mq_pop_relaxed(struct multiqueue *mq, uint64_t *key)
+{
+    unsigned int tries = 0;
+
+    while (1) {
+        struct multiqueue_heap *h1 = &mq->heaps[mq_random(mq->nheaps)];
+        struct multiqueue_heap *h2 = &mq->heaps[mq_random(mq->nheaps)];
+        struct multiqueue_heap *h = mq_min(h2) < mq_min(h1) ? h2 : h1;
+        struct heapitem *item;
+        uint64_t min;
+
+        /* Both sampled heaps empty: look through all of them before
+         * concluding that the queue is */
+        if (mq_min(h) == MULTIQUEUE_EMPTY) {
+            h = mq_find_min(mq, &min);
+
+            if (!h)
+                return NULL;
+        }
+
+        if (!mq_trylock(h)) {
+            mq_backoff(mq, ++tries);
+            continue;
+        }
+
+        item = mq_pop_locked(h, key);
+
+        if (item)
+            return item;
+    }
+}
+
+struct heapitem *multiqueue_pop(struct multiqueue *mq, uint64_t *key)
+{
+    if (mq->flags & MULTIQUEUE_F_STRICT)
+        return mq_pop_strict(mq, key);
+
+    return mq_pop_relaxed(mq, key);
+}
+
+int multiqueue_peek(struct multiqueue *mq, uint64_t *key)
+{
+    return mq_find_min(mq, key) ? 0 : -1;
+}
@@ -0,0 +1,130 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Radix heap.
+ *
+ * Bucket 0 holds the items whose key equals the last minimum, and
+ * bucket b > 0 those whose key first differs from it in bit b - 1,
+ * counting from the least significant bit. Every key in bucket b is
+ * thus smaller than every key in bucket b + 1. When bucket 0 is
+ * empty, the smallest item is found by scanning the first non-empty
+ * bucket, which is found from a bitmap. Once that item is removed,
+ * its key becomes the new minimum and the rest of its bucket is
+ * spread over the buckets below.
+ *
+ * Looking at the smallest item does not advance the minimum, since a
+ * timer queue peeks at its first deadline while earlier deadlines
+ * may still be added. The item found is cached until it is removed
+ * or a smaller key is inserted, so repeated peeks do not rescan.
+ *
+ * Author: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#include <ckit/radixheap.h>
+
+static inline unsigned int radixheap_bucket(const struct radixheap *rh,
+                                            uint64_t key)
+{
+    return key == rh->last ? 0 : 64 - __builtin_clzll(key ^ rh->last);
+}
+
+static inline void radixheap_link(struct radixheap *rh,
+                                  struct radixitem *item)
+{
+    item->bucket = radixheap_bucket(rh, item->key);
+    list_add_back(&rh->buckets[item->bucket], &item->lh);
+
+    if (item->bucket)
+        rh->nonempty |= 1ULL << (item->bucket - 1);
+}
+
+void radixheap_init(struct radixheap *rh)
+{
+    unsigned int i;
+
+    rh->size = 0;
+    rh->last = 0;
+    rh->nonempty = 0;
+    rh->min = NULL;
+
+    for (i = 0; i < RADIXHEAP_BUCKETS; i++)
+        INIT_LIST(&rh->buckets[i]);
+}
+
+void radixheap_insert(struct radixheap *rh, struct radixitem *item,
+                      uint64_t key)
+{
+    item->key = key < rh->last ? rh->last : key;
+    item->active = 1;
+    radixheap_link(rh, item);
+    rh->size++;
+
+    if (rh->min && item->key < rh->min->key)
+        rh->min = item;
+}
+
+void radixheap_remove(struct radixheap *rh, struct radixitem *item)
+{
+    list_del(&item->lh);
+
+    if (item->bucket && list_empty(&rh->buckets[item->bucket]))
+        rh->nonempty &= ~(1ULL << (item->bucket - 1));
+
+    if (item == rh->min)
+        rh->min = NULL;
+
+    item->bucket = 0;
+    item->active = 0;
+    rh->size--;
+}
+
+void radixheap_update(struct radixheap *rh, struct radixitem *item,
+                      uint64_t key)
+{
+    radixheap_remove(rh, item);
+    radixheap_insert(rh, item, key);
+}
+
+struct radixitem *radixheap_front(struct radixheap *rh)
+{
+    struct list *bucket, *l;
+
+    if (!list_empty(&rh->buckets[0]))
+        return list_front(&rh->buckets[0], struct radixitem, lh);
+
+    if (rh->min || rh->nonempty == 0)
+        return rh->min;
+
+    bucket = &rh->buckets[__builtin_ctzll(rh->nonempty) + 1];
+
+    for (l = bucket->next; l != bucket; l = l->next) {
+        struct radixitem *item = list_entry(l, struct radixitem, lh);
+
+        if (!rh->min || item->key < rh->min->key)
+            rh->min = item;
+    }
+    return rh->min;
+}
+
+struct radixitem *radixheap_remove_first(struct radixheap *rh)
+{
+    struct radixitem *item = radixheap_front(rh);
+    struct list *bucket, *l, *next;
+
+    if (!item)
+        return NULL;
+
+    if (item->bucket) {
+        bucket = &rh->buckets[item->bucket];
+        rh->last = item->key;
+        rh->nonempty &= ~(1ULL << (item->bucket - 1));
+
+        /* All items now differ from the minimum in a lower bit */
+        for (l = bucket->next; l != bucket; l = next) {
+            next = l->next;
+            radixheap_link(rh, list_entry(l, struct radixitem, lh));
+        }
+        INIT_LIST(bucket);
+    }
+    radixheap_remove(rh, item);
+
+    return item;
+}
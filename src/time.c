@@ -0,0 +1,231 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Clock sources behind ck_now_ns().
+ *
+ * All sources count nanoseconds on the CLOCK_MONOTONIC timebase, so
+ * their readings can be mixed, e.g., with a timerfd. Each thread
+ * selects its own source, which lets an event loop thread read a
+ * cached time while other threads read the clock.
+ *
+ * The TSC source scales the CPU's time stamp counter with a factor
+ * measured once against CLOCK_MONOTONIC. Each thread extrapolates
+ * from an anchor, a pair of TSC and CLOCK_MONOTONIC readings, that it
+ * takes again on every ck_now_update() and at least once a second,
+ * so that any error in the factor cannot accumulate. It requires an
+ * invariant TSC, which ticks at a constant rate in all power states
+ * and is synchronized across CPUs, and is only built for x86-64.
+ *
+ * Author: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <ckit/time.h>
+#include <ckit/debug.h>
+/* Scaling uses 128-bit arithmetic, which 32-bit targets lack */
+#if defined(__x86_64__)
+#include <cpuid.h>
+#define HAVE_TSC 1
+#endif
+
+/* Fixed point fraction bits of the TSC scale factor */
+#define TSC_SHIFT 32
+
+/* Time to measure the TSC frequency over, in nanoseconds */
+#define TSC_CALIBRATION_NS (20 * NSEC_PER_MSEC)
+
+static __thread enum ck_clock_source source = CK_CLOCK_MONOTONIC;
+static __thread uint64_t cached_ns;
+
+static uint64_t monotonic_ns(void)
+{
+#if _POSIX_TIMERS > 0
+    struct timespec ts;
+
+    /* Not logged, since logging reads the time */
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        return 0;
+
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+#else
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + now.tv_usec * NSEC_PER_USEC;
+#endif
+}
+
+static uint64_t coarse_ns(void)
+{
+#if defined(CLOCK_MONOTONIC_COARSE)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0)
+        return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+#endif
+    return monotonic_ns();
+}
+
+#if defined(HAVE_TSC)
+static pthread_once_t tsc_once = PTHREAD_ONCE_INIT;
+static uint64_t tsc_mult; /* Nanoseconds per cycle << TSC_SHIFT, 0 if unusable */
+static uint64_t tsc_anchor_cycles; /* Cycles between anchors */
+
+static __thread uint64_t anchor_tsc, anchor_ns, last_ns;
+
+static inline uint64_t rdtsc(void)
+{
+    return __builtin_ia32_rdtsc();
+}
+
+/*
+  Read CLOCK_MONOTONIC and the TSC at about the same time, taking the
+  TSC midway between two readings around the clock read.
+*/
+static uint64_t tsc_sample(uint64_t *tsc)
+{
+    uint64_t t0 = rdtsc(), ns = monotonic_ns(), t1 = rdtsc();
+
+    *tsc = t0 + (t1 - t0) / 2;
+
+    return ns;
+}
+
+static int tsc_invariant(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) ||
+        eax < 0x80000007)
+        return 0;
+
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+
+    return (edx >> 8) & 1;
+}
+
+static void tsc_calibrate(void)
+{
+    uint64_t tsc0, tsc1, ns0, ns1;
+
+    if (!tsc_invariant()) {
+        LOG_WARN("No invariant TSC, not using it as clock\n");
+        return;
+    }
+
+    ns0 = tsc_sample(&tsc0);
+
+    do {
+        ns1 = tsc_sample(&tsc1);
+    } while (ns1 - ns0 < TSC_CALIBRATION_NS);
+
+    if (tsc1 <= tsc0)
+        return;
+
+    tsc_mult = (uint64_t)(((unsigned __int128)(ns1 - ns0) << TSC_SHIFT) /
+                          (tsc1 - tsc0));
+    tsc_anchor_cycles = (tsc1 - tsc0) * (NSEC_PER_SEC / TSC_CALIBRATION_NS);
+}
+
+static uint64_t tsc_anchor(void)
+{
+    uint64_t ns = tsc_sample(&anchor_tsc);
+
+    anchor_ns = ns;
+
+    /* The new anchor may be a little behind the extrapolated time */
+    if (ns < last_ns)
+        ns = last_ns;
+
+    last_ns = ns;
+
+    return ns;
+}
+
+static inline uint64_t tsc_ns(void)
+{
+    uint64_t cycles = rdtsc() - anchor_tsc, ns;
+
+    if (cycles > tsc_anchor_cycles)
+        return tsc_anchor();
+
+    ns = anchor_ns + (uint64_t)(((unsigned __int128)cycles * tsc_mult) >>
+                                TSC_SHIFT);
+    if (ns > last_ns)
+        last_ns = ns;
+
+    return last_ns;
+}
+#endif /* HAVE_TSC */
+
+int ck_clock_set_source(enum ck_clock_source src)
+{
+    switch (src) {
+    case CK_CLOCK_MONOTONIC:
+    case CK_CLOCK_CACHED:
+        break;
+    case CK_CLOCK_COARSE:
+#if !defined(CLOCK_MONOTONIC_COARSE)
+        return -1;
+#endif
+        break;
+    case CK_CLOCK_TSC:
+#if defined(HAVE_TSC)
+        pthread_once(&tsc_once, tsc_calibrate);
+
+        if (tsc_mult == 0)
+            return -1;
+
+        tsc_anchor();
+        break;
+#else
+        return -1;
+#endif
+    default:
+        return -1;
+    }
+
+    source = src;
+    cached_ns = 0;
+
+    return 0;
+}
+
+enum ck_clock_source ck_clock_get_source(void)
+{
+    return source;
+}
+
+uint64_t ck_now_update(void)
+{
+#if defined(HAVE_TSC)
+    if (source == CK_CLOCK_TSC) {
+        cached_ns = tsc_anchor();
+        return cached_ns;
+    }
+#endif
+    cached_ns = monotonic_ns();
+
+    return cached_ns;
+}
+
+uint64_t ck_now_ns(void)
+{
+    switch (source) {
+    case CK_CLOCK_COARSE:
+        return coarse_ns();
+    case CK_CLOCK_CACHED:
+        if (cached_ns == 0)
+            return ck_now_update();
+        return cached_ns;
+#if defined(HAVE_TSC)
+    case CK_CLOCK_TSC:
+        return tsc_ns();
+#endif
+    case CK_CLOCK_MONOTONIC:
+    default:
+        break;
+    }
+    return monotonic_ns();
+}
@@ -12,38 +12,220 @@
 #include <poll.h>
 #include <ckit/timer.h>
 #include <ckit/debug.h>
+#include <ckit/atomic.h>
 #include <time.h>
+#if defined(OS_LINUX)
+#include <sys/timerfd.h>
+#endif
+
+/* Deadlines are absolute times on the timebase of ck_now_ns(), which
+ * a timerfd on this clock can also be armed with */
+#define CLOCK CLOCK_MONOTONIC
 
-#define CLOCK CLOCK_THREAD_CPUTIME_ID
+/* Operations submitted to an owned queue by other threads */
+enum timer_op {
+    TIMER_OP_NONE,
+    TIMER_OP_MOD,
+    TIMER_OP_DEL,
+};
 
+/*
+  Get the time from the calling thread's clock source, see
+  ck_clock_set_source().
+*/
 static int gettime(struct timespec *ts)
 {
-    int err = 0;
+    uint64_t now = ck_now_ns();
 
-#if _POSIX_TIMERS > 0
-    err = clock_gettime(CLOCK, ts);
+    ts->tv_sec = now / NSEC_PER_SEC;
+    ts->tv_nsec = now % NSEC_PER_SEC;
 
-	if (err == -1) {
-		LOG_ERR("clock_gettime failed: %s\n", 
-                strerror(errno));
-	}
-#else
-    struct timeval now;
+    return 0;
+}
 
-    gettimeofday(&now, NULL);
 
-    ts->tv_sec = now.tv_sec;
-    ts->tv_nsec = now.tv_usec * 1000;
-#endif
-    return err;
+/*
+  The timer's sort key in the queue: its timeout in nanoseconds.
+*/
+static inline uint64_t timer_key(const struct timer *t)
+{
+    return (uint64_t)t->timeout.tv_sec * NSEC_PER_SEC + t->timeout.tv_nsec;
+}
+
+static inline void timer_set_key(struct timer *t, uint64_t key)
+{
+    t->timeout.tv_sec = key / NSEC_PER_SEC;
+    t->timeout.tv_nsec = key % NSEC_PER_SEC;
+}
+
+/*
+  Lock the queue, unless it is owned, in which case only the owner
+  thread uses it.
+*/
+static inline void timer_queue_lock(struct timer_queue *tq)
+{
+    if (!tq->owned)
+        pthread_mutex_lock(&tq->lock);
+}
+
+static inline void timer_queue_unlock(struct timer_queue *tq)
+{
+    if (!tq->owned)
+        pthread_mutex_unlock(&tq->lock);
+}
+
+/*
+  Whether the calling thread must submit its operations to the
+  queue's inbox rather than apply them.
+*/
+static inline int timer_queue_foreign(struct timer_queue *tq)
+{
+    return tq->owned && !pthread_equal(tq->thr, pthread_self());
+}
+
+/*
+  Round a deadline up to the next multiple of the timer's slack, or
+  the queue's if the timer has none. Boundaries are on the absolute
+  clock, so timers due within the same slack window share a deadline
+  and expire together.
+*/
+static void timer_round_deadline(struct timer_queue *tq,
+                                 const struct timer *t,
+                                 struct timespec *timeout)
+{
+    uint64_t slack, ns;
+
+    /* Any negative slack, not only TIMER_NO_SLACK, would otherwise be
+     * taken as a huge one */
+    if (t->slack < 0)
+        return;
+
+    slack = t->slack ? (uint64_t)t->slack * NSEC_PER_USEC : tq->slack;
+
+    if (slack <= 1)
+        return;
+
+    ns = (uint64_t)timeout->tv_sec * NSEC_PER_SEC + timeout->tv_nsec;
+    ns += slack - 1;
+    ns -= ns % slack;
+
+    timeout->tv_sec = ns / NSEC_PER_SEC;
+    timeout->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+/*
+  Backend operations on the queue. All are called with the queue
+  locked.
+*/
+static inline int queue_empty(struct timer_queue *tq)
+{
+    if (tq->backend == TIMER_BACKEND_RADIX)
+        return radixheap_empty(&tq->radix);
+
+    if (tq->backend == TIMER_BACKEND_WHEEL)
+        return timerwheel_empty(&tq->wheel);
+
+    return keyheap_empty(&tq->queue);
+}
+
+static inline struct timer *queue_first(struct timer_queue *tq)
+{
+    if (queue_empty(tq))
+        return NULL;
+
+    if (tq->backend == TIMER_BACKEND_RADIX)
+        return radixheap_entry(radixheap_front(&tq->radix), struct timer, ri);
+
+    if (tq->backend == TIMER_BACKEND_WHEEL)
+        return timerwheel_entry(timerwheel_front(&tq->wheel),
+                                struct timer, wi);
+
+    return keyheap_first_entry(&tq->queue, struct timer, hi);
+}
+
+static inline struct timer *queue_remove_first(struct timer_queue *tq)
+{
+    if (queue_empty(tq))
+        return NULL;
+
+    if (tq->backend == TIMER_BACKEND_RADIX)
+        return radixheap_entry(radixheap_remove_first(&tq->radix),
+                               struct timer, ri);
+
+    if (tq->backend == TIMER_BACKEND_WHEEL)
+        return timerwheel_entry(timerwheel_remove_first(&tq->wheel),
+                                struct timer, wi);
+
+    return keyheap_remove_first_entry(&tq->queue, struct timer, hi);
+}
+
+/*
+  Insert the timer, or move it if already scheduled.
+*/
+static int queue_insert(struct timer_queue *tq, struct timer *t)
+{
+    if (tq->backend == TIMER_BACKEND_RADIX) {
+        if (timer_scheduled(t))
+            radixheap_update(&tq->radix, &t->ri, timer_key(t));
+        else
+            radixheap_insert(&tq->radix, &t->ri, timer_key(t));
+        return 0;
+    }
+
+    if (tq->backend == TIMER_BACKEND_WHEEL) {
+        if (timer_scheduled(t))
+            timerwheel_del(&tq->wheel, &t->wi);
+        timerwheel_add(&tq->wheel, &t->wi, timer_key(t));
+        return 0;
+    }
+
+    if (timer_scheduled(t)) {
+        keyheap_update(&tq->queue, &t->hi, timer_key(t));
+        return 0;
+    }
+    return keyheap_insert(&tq->queue, &t->hi, timer_key(t));
 }
 
+static inline void queue_remove(struct timer_queue *tq, struct timer *t)
+{
+    if (tq->backend == TIMER_BACKEND_RADIX)
+        radixheap_remove(&tq->radix, &t->ri);
+    else if (tq->backend == TIMER_BACKEND_WHEEL)
+        timerwheel_del(&tq->wheel, &t->wi);
+    else
+        keyheap_remove(&tq->queue, t->hi.index);
+}
 
-static int heap_cmp(const struct heapitem *h1, const struct heapitem *h2)
+/*
+  Take the first timer off the queue as expired at time 'now', or, if
+  it is periodic, move it to its next period without taking it off.
+  The next deadline follows from the previous one rather than from
+  'now', skipping any periods already past. Slack is not applied
+  again, so the timer stays in phase with its first deadline.
+*/
+static struct timer *queue_expire_first(struct timer_queue *tq,
+                                        uint64_t now)
 {
-    struct timer *t1 = heap_entry(h1, struct timer, hi); 
-    struct timer *t2 = heap_entry(h2, struct timer, hi); 
-    return timespec_lt(&t1->timeout, &t2->timeout);
+    struct timer *t = queue_first(tq);
+    uint64_t key, interval;
+
+    if (!t || t->interval <= 0)
+        return queue_remove_first(tq);
+
+    key = timer_key(t);
+    interval = (uint64_t)t->interval * NSEC_PER_USEC;
+    key += interval;
+
+    if (key <= now)
+        key += ((now - key) / interval + 1) * interval;
+
+    timer_set_key(t, key);
+
+    /* Scheduled already, so this sifts the timer down in place */
+    if (queue_insert(tq, t))
+        return queue_remove_first(tq);
+
+    return t;
 }
 
 struct timer *timer_new_callback(void (*callback)(struct timer *), 
@@ -61,20 +243,205 @@ struct timer *timer_new_callback(void (*callback)(struct timer *),
 	return t;
 }
 
+/*
+  Take a timer off the list of expired timers whose callbacks are yet
+  to run, if it is on it. Called with the queue locked.
+*/
+static inline void timer_unexpire(struct timer *t)
+{
+    if (t->el.next && !list_empty(&t->el))
+        list_del(&t->el);
+}
+
+#if defined(OS_LINUX)
+/*
+  Make the timerfd expire right away.
+*/
+static int timerfd_raise(struct timer_queue *tq)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_nsec = 1;
+
+    return timerfd_settime(tq->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+  Arm the timerfd for the given timer's deadline, or disarm it if
+  NULL, unless already armed for it. Called with the queue locked.
+*/
+static int timerfd_arm(struct timer_queue *tq, const struct timer *t)
+{
+    struct itimerspec its;
+    uint64_t deadline = t ? timer_key(t) : 0;
+
+    /* A raised queue stays armed to expire right away */
+    if (tq->raised || deadline == tq->armed)
+        return 0;
+
+    memset(&its, 0, sizeof(its));
+
+    /* A zero value disarms the timerfd, so a deadline at time zero
+     * is armed as one nanosecond */
+    if (t) {
+        its.it_value = t->timeout;
+
+        if (!timespec_nz(&its.it_value))
+            its.it_value.tv_nsec = 1;
+    }
+
+    if (timerfd_settime(tq->timerfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+        LOG_ERR("timerfd_settime failed: %s\n", strerror(errno));
+        return -1;
+    }
+    tq->armed = deadline;
+
+    /* This may have overridden a raise by a thread that submitted
+     * operations to an owned queue, so raise it again if any are
+     * pending */
+    if (tq->owned && __atomic_load_n(&tq->inbox, __ATOMIC_SEQ_CST)) {
+        tq->raised = 1;
+        tq->armed = 0;
+        return timerfd_raise(tq);
+    }
+
+    return 0;
+}
+
+/*
+  Arm the timerfd for the first timer's deadline. Finding the first
+  timer may scan part of a radix heap or timing wheel, so this is
+  only done when expiring timers or lowering the signal.
+*/
+static int timerfd_rearm(struct timer_queue *tq)
+{
+    return timerfd_arm(tq, queue_first(tq));
+}
+#endif
+
+/*
+  Bring the timerfd up to date with the first timer after expiring
+  timers. Called with the queue locked.
+*/
+static void timer_queue_rearm(struct timer_queue *tq)
+{
+#if defined(OS_LINUX)
+    if (tq->timerfd != -1)
+        timerfd_rearm(tq);
+#endif
+}
+
+/*
+  Let the main thread know that a timer was scheduled, if it is due
+  before the deadline the main thread waits for. That deadline is
+  never later than the first timer's, so the timer is then the first
+  one, and the first timer need not be looked up. Called with the
+  queue locked.
+*/
+static void timer_queue_notify_add(struct timer_queue *tq,
+                                   const struct timer *t)
+{
+    if (tq->armed && timer_key(t) >= tq->armed)
+        return;
+
+#if defined(OS_LINUX)
+    if (tq->timerfd != -1) {
+        timerfd_arm(tq, t);
+        return;
+    }
+#endif
+    tq->armed = timer_key(t);
+
+    if (!pthread_equal(tq->thr, pthread_self()))
+        timer_queue_signal_raise(tq);
+}
+
+/*
+  Let the main thread know that a timer due at 'deadline' was
+  removed, if the main thread waits for that deadline, so that it
+  can wait for a later one. A timerfd is left armed, and when it
+  expires early, rearming it finds the new first timer. Called with
+  the queue locked.
+*/
+static void timer_queue_notify_del(struct timer_queue *tq,
+                                   uint64_t deadline)
+{
+    if (deadline != tq->armed || tq->timerfd != -1)
+        return;
+
+    if (!pthread_equal(tq->thr, pthread_self()))
+        timer_queue_signal_raise(tq);
+}
+
+/*
+  Record the first timer, which the main thread is about to wait
+  for. A timerfd instead keeps the deadline it is armed for. Called
+  with the queue locked.
+*/
+static void timer_queue_waits(struct timer_queue *tq, const struct timer *t)
+{
+    if (tq->timerfd == -1)
+        tq->armed = t ? timer_key(t) : 0;
+}
+
 int timer_queue_get_signal(struct timer_queue *tq)
 {
+    if (tq->timerfd != -1)
+        return tq->timerfd;
+
     return signal_get_fd(&tq->signal);
 }
 
 int timer_queue_signal_raise(struct timer_queue *tq)
 {
+#if defined(OS_LINUX)
+    if (tq->timerfd != -1) {
+        int ret;
+
+        /* The state of an owned queue is left to its owner, which
+         * finds the timerfd expired when lowering it */
+        if (timer_queue_foreign(tq))
+            return timerfd_raise(tq);
+
+        /* Expire right away, and rearm once lowered */
+        timer_queue_lock(tq);
+        tq->raised = 1;
+        tq->armed = 0;
+        ret = timerfd_raise(tq);
+        timer_queue_unlock(tq);
+
+        return ret;
+    }
+#endif
     return signal_raise(&tq->signal);
 }
 
 enum signal_result timer_queue_signal_lower(struct timer_queue *tq)
 {
     int val = 0, ret = 0;
-    
+
+#if defined(OS_LINUX)
+    if (tq->timerfd != -1) {
+        uint64_t expirations;
+
+        ret = read(tq->timerfd, &expirations, sizeof(expirations)) > 0;
+
+        /* An expired timerfd stays disarmed, so arm it again for
+         * whatever timer is now first */
+        timer_queue_lock(tq);
+
+        if (ret) {
+            tq->raised = 0;
+            tq->armed = 0;
+        }
+
+        timerfd_rearm(tq);
+        timer_queue_unlock(tq);
+
+        return ret ? TIMER_SIGNAL_SET : TIMER_SIGNAL_NONE;
+    }
+#endif
     ret = signal_clear_val(&tq->signal, &val);
 
     switch (ret) {
@@ -106,53 +473,238 @@ void timer_init(struct timer *t)
 	memset(t, 0, sizeof(*t));
 }
 
-int timer_mod(struct timer_queue *tq, struct timer *t, 
-              unsigned long expires)
+/*
+  Schedule the timer at the given deadline. Called with the queue
+  locked.
+*/
+static int _timer_mod(struct timer_queue *tq, struct timer *t,
+                      uint64_t deadline)
 {
-    int was_first = 0;
+    uint64_t prev = timer_scheduled(t) ? timer_key(t) : 0;
 
-    if (timer_scheduled(t)) {
-        if (t->hi.index == 0)
-            was_first = 1;
-        timer_del(tq, t);
-        t->expires = expires;
-    }
+    timer_unexpire(t);
+    timer_set_key(t, deadline);
 
-    gettime(&t->timeout);
-    timespec_add_nsec(&t->timeout, t->expires * 1000);
+    /* A scheduled timer is moved within the queue, in one pass */
+    if (queue_insert(tq, t))
+        return -1;
 
-	pthread_mutex_lock(&tq->lock);
+    /* If another thread than the "main" thread moved the timer the
+     * main thread waits for, or scheduled one before it, then raise
+     * the signal to make the main thread reschedule itself to reflect
+     * the new timeout. A timerfd is instead rearmed from any thread
+     * for an earlier deadline. */
+    if (prev)
+        timer_queue_notify_del(tq, prev);
 
-    if (heap_insert(&tq->queue, &t->hi)) {
-        pthread_mutex_unlock(&tq->lock);
+    timer_queue_notify_add(tq, t);
+
+    return 0;
+}
+
+static void _timer_del(struct timer_queue *tq, struct timer *t);
+
+/*
+  Submit an operation on a timer to an owned queue from another
+  thread. The timer is pushed onto the inbox unless it already has an
+  operation pending, which is then replaced. Only a push onto an
+  empty inbox wakes up the owner, which takes all of it at once.
+*/
+static int timer_submit(struct timer_queue *tq, struct timer *t, int op,
+                        long expires, uint64_t deadline)
+{
+    struct timer *head;
+    int pending;
+
+    __atomic_store_n(&t->op_expires, expires, __ATOMIC_RELAXED);
+    __atomic_store_n(&t->op_deadline, deadline, __ATOMIC_RELAXED);
+
+    /* Pairs with the owner taking the operation, after which it no
+     * longer touches the timer's inbox link */
+    pending = __atomic_load_n(&t->op, __ATOMIC_RELAXED);
+
+    while (!__atomic_compare_exchange_n(&t->op, &pending, op, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        ;
+
+    /* Still in the inbox, where the owner picks up the new operation */
+    if (pending != TIMER_OP_NONE)
+        return 0;
+
+    head = __atomic_load_n(&tq->inbox, __ATOMIC_RELAXED);
+
+    do {
+        t->next_op = head;
+    } while (!__atomic_compare_exchange_n(&tq->inbox, &head, t, 1,
+                                          __ATOMIC_SEQ_CST,
+                                          __ATOMIC_RELAXED));
+
+    if (head == NULL && timer_queue_signal_raise(tq) == -1)
         return -1;
+
+    return 0;
+}
+
+int timer_queue_drain(struct timer_queue *tq)
+{
+    struct timer *t, *next, *list = NULL;
+    int n = 0;
+
+    if (!tq->owned || !__atomic_load_n(&tq->inbox, __ATOMIC_RELAXED))
+        return 0;
+
+    t = __atomic_exchange_n(&tq->inbox, NULL, __ATOMIC_ACQUIRE);
+
+    /* The inbox is LIFO, so reverse it to apply operations in the
+     * order they were submitted. The timers cannot be pushed again
+     * until their operations are taken below. */
+    while (t) {
+        next = t->next_op;
+        t->next_op = list;
+        list = t;
+        t = next;
     }
 
-    /* If another thread than the "main" thread added or removed a
-     * timer at the first position in the heap, then raise the signal
-     * to make the main thread reschedule itself to reflect the new
-     * timeout */
-    if (!pthread_equal(tq->thr, pthread_self()) &&
-        (t->hi.index == 0 || was_first == 1)) {
-        timer_queue_signal_raise(tq);
+    for (t = list; t; t = next) {
+        next = t->next_op;
+
+        /* Once taken, the timer may be submitted again, in which case
+         * the deadline read may already be that of the next
+         * operation, which is then just applied twice */
+        switch (__atomic_exchange_n(&t->op, TIMER_OP_NONE,
+                                    __ATOMIC_ACQ_REL)) {
+        case TIMER_OP_MOD:
+            t->expires = __atomic_load_n(&t->op_expires, __ATOMIC_RELAXED);
+
+            if (_timer_mod(tq, t, __atomic_load_n(&t->op_deadline,
+                                                  __ATOMIC_RELAXED)) == -1)
+                LOG_ERR("Could not schedule submitted timer\n");
+            break;
+        case TIMER_OP_DEL:
+            _timer_del(tq, t);
+            break;
+        default:
+            break;
+        }
+        n++;
     }
-    
-	pthread_mutex_unlock(&tq->lock);
+
+    return n;
+}
+
+int timer_mod(struct timer_queue *tq, struct timer *t, 
+              unsigned long expires)
+{
+    struct timespec timeout;
+    int ret;
+
+    gettime(&timeout);
+    timespec_add_nsec(&timeout, expires * 1000);
+    timer_round_deadline(tq, t, &timeout);
+
+    /* The timer's own fields belong to the owner until the
+     * operation is applied */
+    if (timer_queue_foreign(tq))
+        return timer_submit(tq, t, TIMER_OP_MOD, expires,
+                            (uint64_t)timeout.tv_sec * NSEC_PER_SEC +
+                            timeout.tv_nsec) ? -1 : 1;
+
+    timer_queue_lock(tq);
+
+    /* Apply operations submitted earlier to an owned queue first */
+    timer_queue_drain(tq);
+
+    t->expires = expires;
+    ret = _timer_mod(tq, t, (uint64_t)timeout.tv_sec * NSEC_PER_SEC +
+                     timeout.tv_nsec);
+
+	timer_queue_unlock(tq);
 	
-	return 1;
+	return ret == -1 ? -1 : 1;
 }
 
 
+int timer_add_many(struct timer_queue *tq, struct timer **timers,
+                   unsigned int n)
+{
+    struct keyheap_entry *entries;
+    struct timespec now;
+    unsigned int i, first = 0;
+    int ret;
+
+    if (timer_queue_foreign(tq)) {
+        for (i = 0; i < n; i++) {
+            if (timer_add(tq, timers[i]) == -1)
+                return -1;
+        }
+        return 0;
+    }
+
+    entries = malloc(sizeof(*entries) * (n ? n : 1));
+
+    if (!entries)
+        return -1;
+
+    gettime(&now);
+
+    for (i = 0; i < n; i++) {
+        if (timer_scheduled(timers[i])) {
+            free(entries);
+            return -1;
+        }
+        timers[i]->timeout = now;
+        timespec_add_nsec(&timers[i]->timeout, timers[i]->expires * 1000);
+        timer_round_deadline(tq, timers[i], &timers[i]->timeout);
+        entries[i].key = timer_key(timers[i]);
+        entries[i].item = &timers[i]->hi;
+
+        if (entries[i].key < entries[first].key)
+            first = i;
+    }
+
+    timer_queue_lock(tq);
+    timer_queue_drain(tq);
+
+    for (i = 0; i < n; i++)
+        timer_unexpire(timers[i]);
+
+    if (tq->backend == TIMER_BACKEND_RADIX) {
+        for (i = 0; i < n; i++)
+            radixheap_insert(&tq->radix, &timers[i]->ri, entries[i].key);
+        ret = 0;
+    } else if (tq->backend == TIMER_BACKEND_WHEEL) {
+        for (i = 0; i < n; i++)
+            timerwheel_add(&tq->wheel, &timers[i]->wi, entries[i].key);
+        ret = 0;
+    } else {
+        ret = keyheap_insert_many(&tq->queue, entries, n);
+    }
+
+    /* Only the earliest of the timers can be the new first one, see
+     * _timer_mod() */
+    if (ret == 0 && n > 0)
+        timer_queue_notify_add(tq, timers[first]);
+
+    timer_queue_unlock(tq);
+
+    free(entries);
+
+    return ret;
+}
+
 static void _timer_del(struct timer_queue *tq, struct timer *t)
 {
-    unsigned int index = t->hi.index;
+    timer_unexpire(t);
 
-    heap_remove(&tq->queue, index);
+    if (!timer_scheduled(t))
+        return;
 
-    /* Reschedule in case we removed the first item in the
-       queue */
-    if (index == 0 && !pthread_equal(tq->thr, pthread_self()))
-        timer_queue_signal_raise(tq);
+    queue_remove(tq, t);
+
+    /* Reschedule in case we removed the timer the main thread waits
+     * for. This does not look up the new first timer, which would
+     * rescan part of a radix heap or timing wheel on every cancel. */
+    timer_queue_notify_del(tq, timer_key(t));
 }
 
 int timer_add(struct timer_queue *tq, struct timer *t)
@@ -165,9 +717,16 @@ int timer_add(struct timer_queue *tq, struct timer *t)
 
 void timer_del(struct timer_queue *tq, struct timer *t)
 {
-	pthread_mutex_lock(&tq->lock);
+    if (timer_queue_foreign(tq)) {
+        if (timer_submit(tq, t, TIMER_OP_DEL, 0, 0) == -1)
+            LOG_ERR("Could not wake up the timer queue owner\n");
+        return;
+    }
+
+	timer_queue_lock(tq);
+    timer_queue_drain(tq);
     _timer_del(tq, t);
-	pthread_mutex_unlock(&tq->lock);
+	timer_queue_unlock(tq);
 }
 
 int timer_next_timeout(struct timer_queue *tq, unsigned long *timeout)
@@ -175,24 +734,28 @@ int timer_next_timeout(struct timer_queue *tq, unsigned long *timeout)
 	struct timer *t;
     struct timespec now, later;
 
-	pthread_mutex_lock(&tq->lock);
+    /* Lower the signal before looking at the queue, so that changes
+     * made meanwhile by other threads raise it again */
+    timer_queue_signal_lower(tq);
+
+	timer_queue_lock(tq);
+    timer_queue_drain(tq);
 
-	if (heap_empty(&tq->queue)) {
-		pthread_mutex_unlock(&tq->lock);
-        timer_queue_signal_lower(tq);
+	if (queue_empty(tq)) {
+        timer_queue_waits(tq, NULL);
+		timer_queue_unlock(tq);
 		return 0;
 	}
 
     gettime(&now);
 
-	t = heap_first_entry(&tq->queue, struct timer, hi);       
+	t = queue_first(tq);       
+    timer_queue_waits(tq, t);
     memcpy(&later, &t->timeout, sizeof(t->timeout));
     timespec_sub(&later, &now);
 	*timeout = later.tv_sec * 1000000 + later.tv_nsec / 1000;
 
-	pthread_mutex_unlock(&tq->lock);
-
-    timer_queue_signal_lower(tq);
+	timer_queue_unlock(tq);
 
 	return 1;
 }
@@ -203,23 +766,26 @@ int timer_next_timeout_timespec(struct timer_queue *tq,
 	struct timer *t;
     struct timespec now;
 
-	pthread_mutex_lock(&tq->lock);
+	timer_queue_lock(tq);
+    timer_queue_drain(tq);
 
-	if (heap_empty(&tq->queue)) {
-		pthread_mutex_unlock(&tq->lock);
+	if (queue_empty(tq)) {
+        timer_queue_waits(tq, NULL);
+		timer_queue_unlock(tq);
 		return 0;
 	}
 
     gettime(&now);
 
-	t = heap_first_entry(&tq->queue, struct timer, hi);
+	t = queue_first(tq);
+    timer_queue_waits(tq, t);
 	memcpy(timeout, &t->timeout, sizeof(*timeout));
     timespec_sub(timeout, &now);
         
     if (timeout->tv_sec < 0)
         timeout->tv_sec = timeout->tv_nsec = 0;
                 
-	pthread_mutex_unlock(&tq->lock);
+	timer_queue_unlock(tq);
 
 	return 1;
 }
@@ -241,17 +807,28 @@ int timer_next_timeout_timeval(struct timer_queue *tq,
 int timer_handle_timeout(struct timer_queue *tq)
 {
 	struct timer *t;
+    uint64_t now;
        
-	pthread_mutex_lock(&tq->lock);
+    /* Also refreshes the cached time for the callbacks */
+    now = ck_now_update();
+
+	timer_queue_lock(tq);
+    timer_queue_drain(tq);
 
-	if (heap_empty(&tq->queue)) {
-		pthread_mutex_unlock(&tq->lock);
+	t = queue_first(tq);
+
+    /* A periodic timer that is not due would be moved to its next
+     * deadline, skipping a period */
+	if (!t || (t->interval > 0 && timer_key(t) > now)) {
+        timer_queue_rearm(tq);
+		timer_queue_unlock(tq);
 		return -1;
 	}
 	
-	t = heap_remove_first_entry(&tq->queue, struct timer, hi);
+	t = queue_expire_first(tq, now);
+    timer_queue_rearm(tq);
 
-	pthread_mutex_unlock(&tq->lock);
+	timer_queue_unlock(tq);
 
 	if (t->callback)
         t->callback(t);
@@ -259,29 +836,85 @@ int timer_handle_timeout(struct timer_queue *tq)
     return 0;
 }
 
+int timer_handle_expired(struct timer_queue *tq, unsigned int budget)
+{
+    struct timer *t;
+    unsigned int n = 0;
+    uint64_t key;
+
+    /* Read the clock precisely once per batch, whatever the source,
+     * which also refreshes the cached time for the callbacks */
+    key = ck_now_update();
+
+	timer_queue_lock(tq);
+    timer_queue_drain(tq);
+
+    /* Move all expired timers to the expired list in one go */
+    while (budget == 0 || n < budget) {
+        t = queue_first(tq);
+
+        if (!t || timer_key(t) > key)
+            break;
+
+        /* A periodic timer stays in the queue, due in the future */
+        queue_expire_first(tq, key);
+        list_add_back(&tq->expired, &t->el);
+        n++;
+    }
+
+    /* Also after expiring nothing, since a timerfd may have expired
+     * early for a deleted timer */
+    timer_queue_rearm(tq);
+
+    n = 0;
+
+    /* Callbacks may delete or reschedule timers further down the
+     * list, which takes them off it, so take one at a time */
+    while (!list_empty(&tq->expired)) {
+        t = list_front(&tq->expired, struct timer, el);
+        list_del(&t->el);
+
+        timer_queue_unlock(tq);
+
+        if (t->callback)
+            t->callback(t);
+        n++;
+
+        timer_queue_lock(tq);
+    }
+
+	timer_queue_unlock(tq);
+
+    return n;
+}
+
 void timer_list_destroy(struct timer_queue *tq)
 {
-	pthread_mutex_lock(&tq->lock);
+	timer_queue_lock(tq);
+    timer_queue_drain(tq);
 
 	while (1) {
 		struct timer *t;
 		
-		if (heap_empty(&tq->queue))
+		if (queue_empty(tq))
 			break;
 		
-		t = heap_remove_first_entry(&tq->queue, struct timer, hi);
+		t = queue_remove_first(tq);
 
 		if (t->destruct)
             t->destruct(t);
     }
-	pthread_mutex_unlock(&tq->lock);	
+	timer_queue_unlock(tq);	
 }
 
-int timer_queue_init(struct timer_queue *tq)
+int timer_queue_init_backend(struct timer_queue *tq,
+                             enum timer_backend backend)
 {
     int ret;
 
     memset(tq, 0, sizeof(*tq));
+    tq->timerfd = -1;
+    INIT_LIST(&tq->expired);
 
     ret = signal_init(&tq->signal);
 
@@ -289,16 +922,149 @@ int timer_queue_init(struct timer_queue *tq)
         LOG_ERR("Signal init failed\n");
     }
 
-    heap_init(&tq->queue, 0, heap_cmp);
+    tq->backend = backend;
+
+    switch (backend) {
+    case TIMER_BACKEND_RADIX:
+        radixheap_init(&tq->radix);
+        break;
+    case TIMER_BACKEND_WHEEL:
+        timerwheel_init(&tq->wheel, TIMER_WHEEL_DEFAULT_TICK * NSEC_PER_USEC);
+        break;
+    case TIMER_BACKEND_HEAP:
+    default:
+        /* Timeouts are kept as integer keys in the heap, so ordering
+         * the queue never touches the timers themselves */
+        tq->backend = TIMER_BACKEND_HEAP;
+        keyheap_init(&tq->queue, 0);
+        break;
+    }
 
     tq->thr = pthread_self();
 
     return ret;
 }
 
-void timer_queue_fini(struct timer_queue *tq)
+int timer_queue_init_wheel(struct timer_queue *tq, unsigned long tick)
+{
+    int ret = timer_queue_init_backend(tq, TIMER_BACKEND_WHEEL);
+
+    if (tick)
+        timerwheel_init(&tq->wheel, (uint64_t)tick * NSEC_PER_USEC);
+
+    return ret;
+}
+
+void timer_queue_set_slack(struct timer_queue *tq, unsigned long slack)
+{
+    tq->slack = (uint64_t)slack * NSEC_PER_USEC;
+}
+
+void timer_queue_set_owner(struct timer_queue *tq)
+{
+    tq->thr = pthread_self();
+    tq->owned = 1;
+}
+
+int timer_queue_init(struct timer_queue *tq)
 {
+    return timer_queue_init_backend(tq, TIMER_BACKEND_HEAP);
+}
+
+int timer_queue_use_timerfd(struct timer_queue *tq)
+{
+#if defined(OS_LINUX)
+    int fd = timerfd_create(CLOCK, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd == -1) {
+        LOG_ERR("timerfd_create failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* The timerfd also wakes the main thread, so the pipe is not
+     * needed */
     signal_destroy(&tq->signal);
+
+    timer_queue_lock(tq);
+    tq->timerfd = fd;
+    tq->armed = 0;
+    tq->raised = 0;
+    timerfd_rearm(tq);
+    timer_queue_unlock(tq);
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+int timer_pool_init(struct timer_pool *pool, unsigned int size)
+{
+    unsigned int i;
+
+    if (posix_memalign((void **)&pool->timers, 64,
+                       sizeof(struct timer) * (size ? size : 1)))
+        return -1;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    INIT_LIST(&pool->free);
+    pool->size = size;
+
+    /* Free timers are linked on their expired list member, which is
+     * reset when they are taken */
+    for (i = 0; i < size; i++)
+        list_add_back(&pool->free, &pool->timers[i].el);
+
+    return 0;
+}
+
+void timer_pool_fini(struct timer_pool *pool)
+{
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->timers);
+}
+
+struct timer *timer_pool_get(struct timer_pool *pool,
+                             void (*callback)(struct timer *t), void *data)
+{
+    struct timer *t = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (!list_empty(&pool->free)) {
+        t = list_front(&pool->free, struct timer, el);
+        list_del(&t->el);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!t)
+        return NULL;
+
+    timer_init(t);
+    t->callback = callback;
+    t->data = data;
+
+    return t;
+}
+
+void timer_pool_put(struct timer_pool *pool, struct timer *t)
+{
+    /* Most recently used first, while still in cache */
+    pthread_mutex_lock(&pool->lock);
+    list_add_front(&pool->free, &t->el);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void timer_queue_fini(struct timer_queue *tq)
+{
+    if (tq->timerfd != -1)
+        close(tq->timerfd);
+    else
+        signal_destroy(&tq->signal);
+
     timer_list_destroy(tq);
-    heap_fini(&tq->queue);
+
+    if (tq->backend == TIMER_BACKEND_HEAP)
+        keyheap_fini(&tq->queue);
 }
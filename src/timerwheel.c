@@ -0,0 +1,153 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Hierarchical timing wheel.
+ *
+ * Ticks are split into 6-bit digits, one per wheel. An item sits in
+ * the wheel of the highest digit in which its tick differs from the
+ * current tick, in the slot given by its own digit there. Since the
+ * current tick is not past any item, all items in a wheel expire
+ * after all items in the wheels below it, and the slots of a wheel
+ * are ordered too. The first item is thus in the first occupied slot
+ * of the lowest occupied wheel, found from the per-wheel bitmaps.
+ * In the finest wheel a slot holds a single tick. In coarser ones
+ * the slot is scanned for its first item, which is then cached.
+ *
+ * Removing the first item advances the current tick to the item's
+ * tick, which only changes the highest differing digit of the items
+ * in the item's slot. Those are cascaded to finer wheels.
+ *
+ * Author: Erik Nordström <erik.nordstrom@gmail.com>
+ */
+#include <ckit/timerwheel.h>
+
+static inline unsigned int wheel_slot(const struct timerwheel *tw,
+                                      uint64_t tick)
+{
+    uint64_t diff = tick ^ tw->now;
+    unsigned int level;
+
+    if (diff == 0)
+        level = 0;
+    else
+        level = (63 - __builtin_clzll(diff)) / TIMERWHEEL_BITS;
+
+    return level * TIMERWHEEL_SLOTS +
+        ((tick >> (level * TIMERWHEEL_BITS)) & (TIMERWHEEL_SLOTS - 1));
+}
+
+static inline void wheel_link(struct timerwheel *tw, struct wheelitem *item)
+{
+    item->slot = wheel_slot(tw, item->tick);
+    list_add_back(&tw->slots[item->slot], &item->lh);
+    tw->occupied[item->slot / TIMERWHEEL_SLOTS] |=
+        1ULL << (item->slot % TIMERWHEEL_SLOTS);
+}
+
+void timerwheel_init(struct timerwheel *tw, uint64_t tick_ns)
+{
+    unsigned int i;
+
+    tw->size = 0;
+    tw->tick_ns = tick_ns ? tick_ns : 1;
+    tw->now = 0;
+    tw->min = NULL;
+
+    for (i = 0; i < TIMERWHEEL_LEVELS; i++)
+        tw->occupied[i] = 0;
+
+    for (i = 0; i < TIMERWHEEL_LEVELS * TIMERWHEEL_SLOTS; i++)
+        INIT_LIST(&tw->slots[i]);
+}
+
+void timerwheel_add(struct timerwheel *tw, struct wheelitem *item,
+                    uint64_t expires_ns)
+{
+    uint64_t tick = expires_ns / tw->tick_ns;
+
+    if (expires_ns % tw->tick_ns)
+        tick++;
+
+    item->tick = tick < tw->now ? tw->now : tick;
+    item->active = 1;
+    wheel_link(tw, item);
+    tw->size++;
+
+    if (tw->min && item->tick < tw->min->tick)
+        tw->min = item;
+}
+
+void timerwheel_del(struct timerwheel *tw, struct wheelitem *item)
+{
+    list_del(&item->lh);
+
+    if (list_empty(&tw->slots[item->slot]))
+        tw->occupied[item->slot / TIMERWHEEL_SLOTS] &=
+            ~(1ULL << (item->slot % TIMERWHEEL_SLOTS));
+
+    if (item == tw->min)
+        tw->min = NULL;
+
+    item->slot = 0;
+    item->active = 0;
+    tw->size--;
+}
+
+struct wheelitem *timerwheel_front(struct timerwheel *tw)
+{
+    struct list *slot, *l;
+    unsigned int level;
+
+    if (tw->min)
+        return tw->min;
+
+    for (level = 0; level < TIMERWHEEL_LEVELS; level++) {
+        if (tw->occupied[level])
+            break;
+    }
+
+    if (level == TIMERWHEEL_LEVELS)
+        return NULL;
+
+    slot = &tw->slots[level * TIMERWHEEL_SLOTS +
+                      __builtin_ctzll(tw->occupied[level])];
+
+    /* A slot in the finest wheel holds only one tick */
+    if (level == 0)
+        return list_front(slot, struct wheelitem, lh);
+
+    for (l = slot->next; l != slot; l = l->next) {
+        struct wheelitem *item = list_entry(l, struct wheelitem, lh);
+
+        if (!tw->min || item->tick < tw->min->tick)
+            tw->min = item;
+    }
+    return tw->min;
+}
+
+struct wheelitem *timerwheel_remove_first(struct timerwheel *tw)
+{
+    struct wheelitem *item = timerwheel_front(tw);
+    struct list *slot, *l, *next;
+
+    if (!item)
+        return NULL;
+
+    if (item->slot >= TIMERWHEEL_SLOTS) {
+        slot = &tw->slots[item->slot];
+        tw->now = item->tick;
+        tw->occupied[item->slot / TIMERWHEEL_SLOTS] &=
+            ~(1ULL << (item->slot % TIMERWHEEL_SLOTS));
+
+        /* Cascade the slot's items to finer wheels */
+        for (l = slot->next; l != slot; l = next) {
+            next = l->next;
+            wheel_link(tw, list_entry(l, struct wheelitem, lh));
+        }
+        INIT_LIST(slot);
+    } else {
+        tw->now = item->tick;
+    }
+    timerwheel_del(tw, item);
+
+    return item;
+}